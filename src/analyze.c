@@ -0,0 +1,531 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <VapourSynth4.h>
+
+#include <libplacebo/colorspace.h>
+#include <libplacebo/renderer.h>
+#include <libplacebo/shaders/custom.h>
+
+#include "vs-placebo.h"
+#include "analyze.h"
+
+//
+// MaxRGB statistics
+//
+// Every work group builds its own histogram in shared memory, then merges it
+// into the global one, so most atomics never leave the group. Values are PQ
+// encoded and non-negative, so their bit patterns order like the floats do.
+//
+
+static const char vspl_hdr_shader_header[] =
+    "#define VSPL_BINS " VSPL_STR(VSPL_HDR_BINS) "u\n"
+    "shared uint vspl_local_peak;\n"
+    "shared uint vspl_local_hist[VSPL_BINS];\n";
+
+static const char vspl_hdr_shader_body[] =
+    "uint lid = gl_LocalInvocationIndex;\n"
+    "uint threads = gl_WorkGroupSize.x * gl_WorkGroupSize.y;\n"
+    "for (uint i = lid; i < VSPL_BINS; i += threads)\n"
+    "    vspl_local_hist[i] = 0u;\n"
+    "if (lid == 0u)\n"
+    "    vspl_local_peak = 0u;\n"
+    "barrier();\n"
+    "\n"
+    "ivec2 pos = ivec2(gl_GlobalInvocationID.xy);\n"
+    "if (all(lessThan(pos, textureSize(vspl_src, 0)))) {\n"
+    "    vec3 rgb = texelFetch(vspl_src, pos, 0).rgb;\n"
+    "    float m = clamp(max(max(rgb.r, rgb.g), rgb.b), 0.0, 1.0);\n"
+    "    atomicMax(vspl_local_peak, floatBitsToUint(m));\n"
+    "    atomicAdd(vspl_local_hist[min(uint(m * float(VSPL_BINS)), VSPL_BINS - 1u)], 1u);\n"
+    "}\n"
+    "barrier();\n"
+    "\n"
+    "for (uint i = lid; i < VSPL_BINS; i += threads) {\n"
+    "    if (vspl_local_hist[i] != 0u)\n"
+    "        atomicAdd(vspl_hist[i], vspl_local_hist[i]);\n"
+    "}\n"
+    "if (lid == 0u)\n"
+    "    atomicMax(vspl_peak, vspl_local_peak);\n";
+
+/**
+ * Converts `frame` to PQ RGB on the GPU and measures its MaxRGB peak and
+ * average into `out`, and its histogram into `hist`. Only the statistics are
+ * read back.
+ */
+bool vspl_hdr_measure(struct priv *p, const VSFrame *frame, const struct pl_color_space *csp,
+                      struct vspl_hdr_record *out, uint32_t hist[VSPL_HDR_BINS], VSCore *core, const VSAPI *vsapi)
+{
+    const VSVideoFormat *fmt = vsapi->getVideoFrameFormat(frame);
+    const VSMap *props = vsapi->getFramePropertiesRO(frame);
+    const bool is_float = fmt->sampleType == stFloat;
+    const int w = vsapi->getFrameWidth(frame, 0);
+    const int h = vsapi->getFrameHeight(frame, 0);
+    int err;
+
+    if (!p->gpu->glsl.compute) {
+        vsapi->logMessage(mtCritical, "HDR statistics need compute shader support!\n", core);
+        return false;
+    }
+
+    struct pl_plane_data data[3];
+    for (int i = 0; i < 3; i++) {
+        data[i] = (struct pl_plane_data) {
+            .type = is_float ? PL_FMT_FLOAT : PL_FMT_UNORM,
+            .width = vsapi->getFrameWidth(frame, i),
+            .height = vsapi->getFrameHeight(frame, i),
+            .pixel_stride = fmt->bytesPerSample,
+            .row_stride = vsapi->getStride(frame, i),
+            .pixels = vsapi->getReadPtr(frame, i),
+            .component_size[0] = fmt->bytesPerSample * 8,
+            .component_map[0] = i,
+        };
+    }
+
+    pl_fmt in_fmt = pl_plane_find_fmt(p->gpu, NULL, &data[0]);
+    pl_fmt rgb_fmt = pl_find_fmt(p->gpu, PL_FMT_FLOAT, 4, 16, 0, PL_FMT_CAP_RENDERABLE | PL_FMT_CAP_SAMPLEABLE);
+    if (!in_fmt || !rgb_fmt) {
+        vsapi->logMessage(mtCritical, "Failed configuring filter: no good texture format!\n", core);
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < 3; i++) {
+        ok &= vspl_tex_recreate(p, &p->tex_in[i], pl_tex_params(
+            .w = data[i].width,
+            .h = data[i].height,
+            .format = in_fmt,
+            .sampleable = true,
+            .host_writable = true,
+            .blit_src = in_fmt->caps & PL_FMT_CAP_BLITTABLE,
+        ));
+    }
+
+    ok &= vspl_tex_recreate(p, &p->tex_tmp[0], pl_tex_params(
+        .w = w,
+        .h = h,
+        .format = rgb_fmt,
+        .renderable = true,
+        .sampleable = true,
+    ));
+
+    ok &= pl_buf_recreate(p->gpu, &p->stats, pl_buf_params(
+        .size = sizeof(uint32_t) * (1 + VSPL_HDR_BINS),
+        .storable = true,
+        .host_readable = true,
+        .host_writable = true,
+    ));
+
+    if (!ok) {
+        vsapi->logMessage(mtCritical, "Failed creating GPU resources!\n", core);
+        return false;
+    }
+
+    // Upload planes
+    struct pl_plane planes[3] = {0};
+    for (int i = 0; i < 3; i++) {
+        vspl_stage_plane(p, i, &data[i]);
+        ok &= pl_upload_plane(p->gpu, &planes[i], &p->tex_in[i], &data[i]);
+    }
+
+    if (!ok) {
+        vsapi->logMessage(mtCritical, "Failed uploading data to the GPU!\n", core);
+        return false;
+    }
+
+    // Convert to RGB, PQ encoded, without any tone mapping
+    struct pl_frame img = {
+        .num_planes = 3,
+        .planes = {planes[0], planes[1], planes[2]},
+        .repr = {
+            .sys = fmt->colorFamily == cfRGB ? PL_COLOR_SYSTEM_RGB : PL_COLOR_SYSTEM_BT_2020_NC,
+            .bits = {
+                .sample_depth = fmt->bytesPerSample * 8,
+                .color_depth = is_float ? fmt->bytesPerSample * 8 : fmt->bitsPerSample,
+            },
+        },
+        .color = *csp,
+    };
+
+    int64_t range = vsapi->mapGetInt(props, "_ColorRange", 0, &err);
+    if (!err)
+        img.repr.levels = range ? PL_COLOR_LEVELS_LIMITED : PL_COLOR_LEVELS_FULL;
+
+    if (fmt->subSamplingW || fmt->subSamplingH) {
+        // FFMS2 prop is -1 to match zimg, libplacebo matches AVChromaLocation
+        int64_t loc = vsapi->mapGetInt(props, "_ChromaLocation", 0, &err);
+        pl_frame_set_chroma_location(&img, err ? PL_CHROMA_LEFT : loc + 1);
+    }
+
+    struct pl_frame target = {
+        .num_planes = 1,
+        .planes = {{
+            .texture = p->tex_tmp[0],
+            .components = 3,
+            .component_mapping = {0, 1, 2},
+        }},
+        .repr = pl_color_repr_rgb,
+        .color = {
+            .primaries = csp->primaries,
+            .transfer = PL_COLOR_TRC_PQ,
+        },
+    };
+
+    struct pl_render_params render_params = pl_render_fast_params;
+    render_params.peak_detect_params = NULL;
+
+    if (!pl_render_image(p->rr, &img, &target, &render_params)) {
+        vsapi->logMessage(mtCritical, "Failed converting frame for HDR statistics!\n", core);
+        return false;
+    }
+
+    // Measure
+    static const uint32_t zero[1 + VSPL_HDR_BINS];
+    pl_buf_write(p->gpu, p->stats, 0, zero, sizeof(zero));
+
+    struct pl_buffer_var vars[2] = {
+        { .var = { .name = "vspl_peak", .type = PL_VAR_UINT, .dim_v = 1, .dim_m = 1, .dim_a = 1 } },
+        { .var = { .name = "vspl_hist", .type = PL_VAR_UINT, .dim_v = 1, .dim_m = 1, .dim_a = VSPL_HDR_BINS } },
+    };
+    vars[0].layout = pl_std430_layout(0, &vars[0].var);
+    vars[1].layout = pl_std430_layout(vars[0].layout.offset + vars[0].layout.size, &vars[1].var);
+
+    const struct pl_shader_desc descs[2] = {
+        {
+            .desc = { .name = "vspl_src", .type = PL_DESC_SAMPLED_TEX },
+            .binding = { .object = p->tex_tmp[0], .sample_mode = PL_TEX_SAMPLE_NEAREST },
+        }, {
+            .desc = { .name = "vspl_stats", .type = PL_DESC_BUF_STORAGE, .access = PL_DESC_ACCESS_READWRITE },
+            .binding = { .object = p->stats },
+            .buffer_vars = vars,
+            .num_buffer_vars = 2,
+        },
+    };
+
+    pl_shader sh = pl_dispatch_begin(p->dp);
+    if (!pl_shader_custom(sh, &(struct pl_custom_shader) {
+        .description = "vs-placebo HDR statistics",
+        .header = vspl_hdr_shader_header,
+        .body = vspl_hdr_shader_body,
+        .compute = true,
+        .compute_group_size = {16, 16},
+        .compute_shmem = sizeof(uint32_t) * (1 + VSPL_HDR_BINS),
+        .descriptors = descs,
+        .num_descriptors = 2,
+    })) {
+        vsapi->logMessage(mtCritical, "Failed building HDR statistics shader!\n", core);
+        pl_dispatch_abort(p->dp, &sh);
+        return false;
+    }
+
+    if (!pl_dispatch_compute(p->dp, pl_dispatch_compute_params(
+        .shader = &sh,
+        .dispatch_size = {(w + 15) / 16, (h + 15) / 16, 1},
+    ))) {
+        vsapi->logMessage(mtCritical, "Failed dispatching HDR statistics shader!\n", core);
+        return false;
+    }
+
+    uint32_t result[1 + VSPL_HDR_BINS];
+    if (!pl_buf_read(p->gpu, p->stats, 0, result, sizeof(result))) {
+        vsapi->logMessage(mtCritical, "Failed downloading data from the GPU!\n", core);
+        return false;
+    }
+
+    uint64_t total = 0;
+    double sum = 0.0;
+    for (int i = 0; i < VSPL_HDR_BINS; i++) {
+        hist[i] = result[1 + i];
+        total += result[1 + i];
+        sum += (i + 0.5) / VSPL_HDR_BINS * result[1 + i];
+    }
+
+    memcpy(&out->max_pq, &result[0], sizeof(float));
+    out->avg_pq = total ? sum / total : 0.0f;
+    out->valid = 1;
+    return true;
+}
+
+/**
+ * Reads a sidecar file and assigns every frame its scene's peak and average.
+ * A new scene starts when the frame average jumps by more than `threshold`
+ * (in PQ). Returns NULL on success, or an error message.
+ */
+const char *vspl_hdr_scenes_load(struct vspl_hdr_scenes *scenes, const char *path, float threshold)
+{
+    *scenes = (struct vspl_hdr_scenes) {0};
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return "Failed opening HDR statistics file!";
+
+    struct vspl_hdr_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+        || memcmp(hdr.magic, VSPL_HDR_MAGIC, sizeof(VSPL_HDR_MAGIC)) != 0
+        || hdr.version != VSPL_HDR_VERSION
+        || hdr.record_size != sizeof(struct vspl_hdr_record)
+        || hdr.num_frames > INT_MAX) {
+        fclose(f);
+        return "Invalid or unsupported HDR statistics file!";
+    }
+
+    const int n = hdr.num_frames;
+    scenes->num_frames = n;
+    scenes->max_pq = calloc(n ? n : 1, sizeof(float));
+    scenes->avg_pq = calloc(n ? n : 1, sizeof(float));
+    if (!scenes->max_pq || !scenes->avg_pq) {
+        fclose(f);
+        vspl_hdr_scenes_free(scenes);
+        return "Failed allocating HDR statistics!";
+    }
+
+    // Frames missing from the file just inherit their scene's values
+    int start = 0, num_valid = 0;
+    float scene_max = 0.0f, prev_avg = -1.0f;
+    double scene_sum = 0.0;
+
+    struct vspl_hdr_record rec;
+    for (int i = 0; i <= n; i++) {
+        const bool have = i < n && fread(&rec, sizeof(rec), 1, f) == 1 && rec.valid;
+        const bool cut = i == n || (have && prev_avg >= 0.0f && fabsf(rec.avg_pq - prev_avg) > threshold);
+
+        if (cut) {
+            for (int j = start; j < i; j++) {
+                scenes->max_pq[j] = scene_max;
+                scenes->avg_pq[j] = num_valid ? scene_sum / num_valid : 0.0f;
+            }
+
+            start = i;
+            num_valid = 0;
+            scene_max = 0.0f;
+            scene_sum = 0.0;
+        }
+
+        if (have) {
+            scene_max = fmaxf(scene_max, rec.max_pq);
+            scene_sum += rec.avg_pq;
+            prev_avg = rec.avg_pq;
+            num_valid++;
+        }
+    }
+
+    fclose(f);
+    return NULL;
+}
+
+void vspl_hdr_scenes_free(struct vspl_hdr_scenes *scenes)
+{
+    free(scenes->max_pq);
+    free(scenes->avg_pq);
+    *scenes = (struct vspl_hdr_scenes) {0};
+}
+
+typedef struct {
+    VSNode *node;
+    const VSVideoInfo *vi;
+    struct vspl_pool *pool;
+    struct pl_color_space csp;
+
+    char *path; // optional
+    FILE *file; // opened on the first frame
+    pthread_mutex_t lock; // guards file
+} AnalyzeData;
+
+/**
+ * Creates the sidecar file and writes its header, unless that already
+ * happened. Called with the lock held. Deferred until the first frame so that
+ * merely loading a script never truncates an existing file.
+ */
+static bool vspl_hdr_open_file(AnalyzeData *d)
+{
+    if (d->file)
+        return true;
+
+    struct vspl_hdr_header hdr = {
+        .magic = VSPL_HDR_MAGIC,
+        .version = VSPL_HDR_VERSION,
+        .num_frames = d->vi->numFrames,
+        .record_size = sizeof(struct vspl_hdr_record),
+    };
+
+    if (!(d->file = fopen(d->path, "wb")))
+        return false;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, d->file) != 1) {
+        fclose(d->file);
+        d->file = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/** Attaches the statistics in the same form Tonemap consumes them. */
+static void vspl_hdr_set_props(VSMap *props, const struct vspl_hdr_record *rec, const uint32_t hist[VSPL_HDR_BINS],
+                               const VSAPI *vsapi)
+{
+    vsapi->mapSetFloat(props, "PLSceneMax", pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, rec->max_pq), maReplace);
+    vsapi->mapSetFloat(props, "PLSceneAvg", pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, rec->avg_pq), maReplace);
+
+    int64_t counts[VSPL_HDR_BINS];
+    for (int i = 0; i < VSPL_HDR_BINS; i++)
+        counts[i] = hist[i];
+
+    vsapi->mapSetIntArray(props, "PLHistogram", counts, VSPL_HDR_BINS);
+}
+
+static const VSFrame *VS_CC VSPlaceboAnalyzeHDRGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    AnalyzeData *d = (AnalyzeData *) instanceData;
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *frame = vsapi->getFrameFilter(n, d->node, frameCtx);
+
+        struct vspl_hdr_record rec = {0};
+        uint32_t hist[VSPL_HDR_BINS];
+        struct priv *p = vspl_pool_acquire(d->pool);
+        bool ok = vspl_hdr_measure(p, frame, &d->csp, &rec, hist, core, vsapi);
+        vspl_pool_release(d->pool, p);
+
+        if (!ok) {
+            vsapi->setFilterError("placebo.AnalyzeHDR: Failed measuring frame!", frameCtx);
+            vsapi->freeFrame(frame);
+            return NULL;
+        }
+
+        // Records have fixed offsets, so frames can finish in any order
+        if (d->path) {
+            const long offset = (long) sizeof(struct vspl_hdr_header) + (long) n * (long) sizeof(struct vspl_hdr_record);
+
+            pthread_mutex_lock(&d->lock);
+            ok = vspl_hdr_open_file(d)
+                && fseek(d->file, offset, SEEK_SET) == 0
+                && fwrite(&rec, sizeof(rec), 1, d->file) == 1;
+            pthread_mutex_unlock(&d->lock);
+
+            if (!ok) {
+                vsapi->setFilterError("placebo.AnalyzeHDR: Failed writing HDR statistics file!", frameCtx);
+                vsapi->freeFrame(frame);
+                return NULL;
+            }
+        }
+
+        // Shares the source's planes, only the props are new
+        VSFrame *dst = vsapi->copyFrame(frame, core);
+        vspl_hdr_set_props(vsapi->getFramePropertiesRW(dst), &rec, hist, vsapi);
+
+        vsapi->freeFrame(frame);
+        return dst;
+    }
+
+    return 0;
+}
+
+static void VS_CC VSPlaceboAnalyzeHDRFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    AnalyzeData *d = (AnalyzeData *) instanceData;
+    vsapi->freeNode(d->node);
+    vspl_pool_destroy(&d->pool);
+    if (d->file)
+        fclose(d->file);
+    free(d->path);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+void VS_CC VSPlaceboAnalyzeHDRCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    AnalyzeData d;
+    AnalyzeData *data;
+    int err;
+    enum pl_log_level log_level;
+
+    log_level = vsapi->mapGetInt(in, "log_level", 0, &err);
+    if (err)
+        log_level = PL_LOG_ERR;
+
+    d.node = vsapi->mapGetNode(in, "clip", 0, 0);
+    d.vi = vsapi->getVideoInfo(d.node);
+
+    const VSVideoFormat *fmt = &d.vi->format;
+    if ((fmt->colorFamily != cfRGB && fmt->colorFamily != cfYUV)
+        || (fmt->sampleType == stInteger ? fmt->bitsPerSample > 16 : fmt->bitsPerSample < 16)) {
+        vsapi->mapSetError(out, "placebo.AnalyzeHDR: Input must be RGB or YUV, 8-16 bit integer or 16/32 bit float!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.vi->numFrames > (LONG_MAX - (long) sizeof(struct vspl_hdr_header)) / (long) sizeof(struct vspl_hdr_record)) {
+        vsapi->mapSetError(out, "placebo.AnalyzeHDR: Clip is too long!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    int src_csp = vsapi->mapGetInt(in, "src_csp", 0, &err);
+    if (err)
+        src_csp = 1;
+
+    switch (src_csp) {
+        case 1:
+            d.csp = pl_color_space_hdr10;
+            break;
+        case 2:
+            d.csp = pl_color_space_bt2020_hlg;
+            break;
+        default:
+            vsapi->mapSetError(out, "placebo.AnalyzeHDR: src_csp must be 1 (HDR10) or 2 (HLG)!");
+            vsapi->freeNode(d.node);
+            return;
+    }
+
+    int num_contexts = vsapi->mapGetIntSaturated(in, "num_contexts", 0, &err);
+    if (err)
+        num_contexts = 1;
+
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS) {
+        vsapi->mapSetError(out, "placebo.AnalyzeHDR: num_contexts must be between 1 and " VSPL_STR(VSPL_MAX_CONTEXTS) "!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.pool = vspl_pool_create(num_contexts, log_level);
+    if (!d.pool) {
+        vsapi->mapSetError(out, "placebo.AnalyzeHDR: Failed initializing GPU contexts!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    const char *path = vsapi->mapGetData(in, "path", 0, &err);
+    d.path = NULL;
+    d.file = NULL;
+
+    if (path) {
+        const int len = vsapi->mapGetDataSize(in, "path", 0, NULL);
+        d.path = malloc(len + 1);
+        memcpy(d.path, path, len);
+        d.path[len] = '\0';
+    }
+
+    data = malloc(sizeof(d));
+    *data = d;
+    pthread_mutex_init(&data->lock, NULL);
+
+    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}};
+
+    vsapi->createVideoFilter(
+        out,
+        "AnalyzeHDR",
+        d.vi,
+        VSPlaceboAnalyzeHDRGetFrame,
+        VSPlaceboAnalyzeHDRFree,
+        fmParallel,
+        deps,
+        1,
+        data,
+        core
+    );
+}
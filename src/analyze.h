@@ -0,0 +1,53 @@
+#ifndef VS_PLACEBO_ANALYZE_H
+#define VS_PLACEBO_ANALYZE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <VapourSynth4.h>
+
+#include "vs-placebo.h"
+
+#define VSPL_HDR_BINS 256
+#define VSPL_HDR_MAGIC "VSPLHDR"
+#define VSPL_HDR_VERSION 2
+
+/**
+ * Sidecar file written by placebo.AnalyzeHDR: one header followed by one
+ * fixed-size record per frame, so frame n lives at
+ * sizeof(header) + n * sizeof(record) and the file can be mapped as-is.
+ * Everything is in native (little-endian) byte order.
+ */
+struct vspl_hdr_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_frames;
+    uint32_t record_size;
+};
+
+/**
+ * Per-frame statistics of MaxRGB, in PQ. Unwritten frames have valid = 0.
+ * Only what Tonemap needs is stored, the histogram is just a frame prop.
+ */
+struct vspl_hdr_record {
+    uint32_t valid;
+    float max_pq;
+    float avg_pq;
+};
+
+/** Scene brightness of every frame, derived from a sidecar file. */
+struct vspl_hdr_scenes {
+    int num_frames;
+    float *max_pq;
+    float *avg_pq;
+};
+
+bool vspl_hdr_measure(struct priv *p, const VSFrame *frame, const struct pl_color_space *csp,
+                      struct vspl_hdr_record *out, uint32_t hist[VSPL_HDR_BINS], VSCore *core, const VSAPI *vsapi);
+
+const char *vspl_hdr_scenes_load(struct vspl_hdr_scenes *scenes, const char *path, float threshold);
+void vspl_hdr_scenes_free(struct vspl_hdr_scenes *scenes);
+
+void VS_CC VSPlaceboAnalyzeHDRCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
+
+#endif //VS_PLACEBO_ANALYZE_H
@@ -4,88 +4,71 @@
 #include <stdlib.h>
 
 #include <VapourSynth4.h>
-#include <VSHelper4.h>
+
+#include <libplacebo/shaders/custom.h>
 
 #include "vs-placebo.h"
 
 typedef struct {
     VSNode *node;
     const VSVideoInfo *vi;
-    void *vf;
+    VSVideoInfo vi_out; // differs from vi if `bits` is given
+    struct vspl_pool *pool;
     unsigned int planes;
     int dither;
+    struct pl_deband_params deband_params[3]; // indexed by plane
     struct pl_render_params *render_params;
-    uint8_t frame_index;
-
-    pthread_mutex_t lock;
 } DebandData;
 
-bool vspl_deband_do_image(DebandData *dbd_data, struct pl_frame *src_img, struct pl_frame *dst_img, VSCore *core, const VSAPI *vsapi)
+/**
+ * Shader index (the grain and dither seed) of a plane of frame `n`. It only
+ * depends on those two, so the output doesn't change with thread count or
+ * request order.
+ */
+static uint8_t vspl_deband_seed(int n, int plane)
 {
-    struct priv *p = dbd_data->vf;
-    bool ok = true;
-
-    for (int i = 0; i < src_img->num_planes; i++) {
-        pl_shader sh = pl_dispatch_begin(p->dp);
-        pl_shader_reset(sh, pl_shader_params(
-            .gpu = p->gpu,
-            .index = dbd_data->frame_index++,
-        ));
-
-        struct pl_sample_src *src = pl_sample_src(
-            .tex = p->tex_in[i]
-        );
-
-        int new_depth = p->tex_out[i]->params.format->component_depth[i];
-
-        pl_shader_deband(sh, src, dbd_data->render_params->deband_params);
-
-        if (dbd_data->dither)
-            pl_shader_dither(sh, new_depth, &p->dither_state, dbd_data->render_params->dither_params);
-
-        ok &= pl_dispatch_finish(p->dp, pl_dispatch_params(
-            .target = p->tex_out[i],
-            .shader = &sh,
-        ));
-    }
-
-    // ok &= pl_render_image(p->rr, src_img, dst_img, dbd_data->render_params);
-
-    if (!ok) {
-        vsapi->logMessage(mtCritical, "placebo.Deband: Failed processing planes!", core);
-    }
-
-    return ok;
+    uint32_t h = (uint32_t) n * 3u + (uint32_t) plane;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h & 0xff;
 }
 
-bool vspl_deband_reconfig(DebandData *dbd_data, VSFrame *dst, VSCore *core, const VSAPI *vsapi, int plane_idx, const struct pl_plane_data *data)
+bool vspl_deband_reconfig(struct priv *p, const struct pl_plane_data *data, int num_planes, const VSVideoFormat *dst_fmt,
+                          VSCore *core, const VSAPI *vsapi)
 {
-    struct priv *p = dbd_data->vf;
-
-    bool ok = true;
-    pl_fmt fmt = pl_plane_find_fmt(p->gpu, NULL, data);
-
-    if (!fmt) {
+    const int out_bits = dst_fmt->bytesPerSample * 8;
+    pl_fmt fmt = pl_plane_find_fmt(p->gpu, NULL, &data[0]);
+    pl_fmt out = pl_find_fmt(p->gpu, dst_fmt->sampleType == stFloat ? PL_FMT_FLOAT : PL_FMT_UNORM, 1, out_bits, out_bits,
+                             PL_FMT_CAP_RENDERABLE | PL_FMT_CAP_HOST_READABLE);
+    if (!fmt || !out) {
         vsapi->logMessage(mtCritical, "placebo.Deband: Failed configuring filter: no good texture format!", core);
         return false;
     }
 
-    ok &= pl_tex_recreate(p->gpu, &p->tex_in[plane_idx], pl_tex_params(
-        .w = data->width,
-        .h = data->height,
-        .format = fmt,
-        .sampleable = true,
-        .host_writable = true,
-    ));
-
-    int vs_plane = data->component_map[0];
-    ok &= pl_tex_recreate(p->gpu, &p->tex_out[plane_idx], pl_tex_params(
-        .w = vsapi->getFrameWidth(dst, vs_plane),
-        .h = vsapi->getFrameHeight(dst, vs_plane),
-        .format = fmt,
-        .renderable = true,
-        .host_readable = true,
-    ));
+    // Textures stay attached to the context, so they are only recreated when the frame size changes
+    bool ok = true;
+    for (int i = 0; i < num_planes; i++) {
+        // Matches the parameters pl_upload_plane() recreates the texture with
+        ok &= vspl_tex_recreate(p, &p->tex_in[i], pl_tex_params(
+            .w = data[i].width,
+            .h = data[i].height,
+            .format = fmt,
+            .sampleable = true,
+            .host_writable = true,
+            .blit_src = fmt->caps & PL_FMT_CAP_BLITTABLE,
+        ));
+
+        ok &= vspl_tex_recreate(p, &p->tex_out[i], pl_tex_params(
+            .w = data[i].width,
+            .h = data[i].height,
+            .format = out,
+            .renderable = true,
+            .host_readable = true,
+        ));
+    }
 
     if (!ok) {
         vsapi->logMessage(mtCritical, "placebo.Deband: Failed creating GPU textures!", core);
@@ -94,44 +77,92 @@ bool vspl_deband_reconfig(DebandData *dbd_data, VSFrame *dst, VSCore *core, cons
     return ok;
 }
 
-bool vspl_deband_upload_plane(DebandData *dbd_data, VSCore *core, const VSAPI *vsapi, int plane_idx, const struct pl_plane_data *data, struct pl_plane *plane)
+/**
+ * Uploads, debands and downloads all planes. Nothing is submitted until the
+ * first download is polled, so the whole frame goes to the GPU as one batch
+ * and is waited on once.
+ */
+bool vspl_deband_filter(struct priv *p, DebandData *dbd_data, int n, VSFrame *dst, struct pl_plane_data *data, int num_planes,
+                        VSCore *core, const VSAPI *vsapi)
 {
-    struct priv *p = dbd_data->vf;
+    const VSVideoFormat *out_fmt = &dbd_data->vi_out.format;
+    bool ok = true;
 
     // Upload planes
-
-    bool ok = pl_upload_plane(p->gpu, plane, &p->tex_in[plane_idx], data);
+    for (int i = 0; i < num_planes; i++) {
+        struct pl_plane plane;
+        vspl_stage_plane(p, i, &data[i]);
+        ok &= pl_upload_plane(p->gpu, &plane, &p->tex_in[i], &data[i]);
+    }
 
     if (!ok) {
-        vsapi->logMessage(mtCritical, "placebo.Deband: Failed downloading data from the GPU!", core);
+        vsapi->logMessage(mtCritical, "placebo.Deband: Failed uploading data to the GPU!", core);
+        return false;
     }
 
-    return ok;
-}
-
-bool vspl_deband_download_planes(DebandData *dbd_data, VSCore *core, const VSAPI *vsapi, VSFrame *vs_dst, const struct pl_plane_data *data, struct pl_frame *dst_img)
-{
-    struct priv *p = dbd_data->vf;
+    // Process planes
+    for (int i = 0; i < num_planes; i++) {
+        const int vs_plane = data[i].component_map[0];
 
-    bool ok = true;
+        pl_shader sh = pl_dispatch_begin(p->dp);
+        pl_shader_reset(sh, pl_shader_params(
+            .gpu = p->gpu,
+            .index = vspl_deband_seed(n, vs_plane),
+        ));
 
-    // Download planes
-    for (int i = 0; i < dst_img->num_planes; i++) {
-        struct pl_plane *target_plane = &dst_img->planes[i];
+        struct pl_sample_src *src = pl_sample_src(
+            .tex = p->tex_in[i]
+        );
 
-        int vs_plane = target_plane->component_mapping[0];
+        // Unselected planes only get here to be converted to the output depth
+        if ((1u << vs_plane) & dbd_data->planes) {
+            pl_shader_deband(sh, src, &dbd_data->deband_params[vs_plane]);
+        } else {
+            pl_shader_sample_direct(sh, src);
+        }
 
-        pl_fmt out_fmt = p->tex_out[i]->params.format;
-        uint8_t *dst_ptr = vsapi->getWritePtr(vs_dst, vs_plane);
-        int dst_row_pitch = (vsapi->getStride(vs_dst, vs_plane) / data[i].pixel_stride) * out_fmt->texel_size;
+        // dither_state only caches the dither matrix, any variation between frames comes from the index
+        if (dbd_data->dither)
+            pl_shader_dither(sh, out_fmt->bitsPerSample, &p->dither_state, dbd_data->render_params->dither_params);
+
+        // Integer samples are LSB-aligned, e.g. 10 bit values in a 16 bit texture
+        if (out_fmt->sampleType == stInteger && out_fmt->bitsPerSample < out_fmt->bytesPerSample * 8) {
+            const float scale = (float) ((1 << out_fmt->bitsPerSample) - 1) / ((1 << (out_fmt->bytesPerSample * 8)) - 1);
+            const struct pl_shader_var var = {
+                .var = pl_var_float("vspl_scale"),
+                .data = &scale,
+            };
+
+            ok &= pl_shader_custom(sh, &(struct pl_custom_shader) {
+                .description = "vs-placebo LSB alignment",
+                .body = "color *= vspl_scale;",
+                .input = PL_SHADER_SIG_COLOR,
+                .output = PL_SHADER_SIG_COLOR,
+                .variables = &var,
+                .num_variables = 1,
+            });
+        }
 
-        ok &= pl_tex_download(p->gpu, pl_tex_transfer_params(
-            .tex = p->tex_out[i],
-            .row_pitch = dst_row_pitch,
-            .ptr = (void *) dst_ptr,
+        ok &= pl_dispatch_finish(p->dp, pl_dispatch_params(
+            .target = p->tex_out[i],
+            .shader = &sh,
         ));
     }
 
+    if (!ok) {
+        vsapi->logMessage(mtCritical, "placebo.Deband: Failed processing planes!", core);
+        return false;
+    }
+
+    // Download planes, issuing all transfers before waiting on any of them
+    for (int i = 0; i < num_planes; i++) {
+        int vs_plane = data[i].component_map[0];
+        ok &= vspl_download_start(p, i, p->tex_out[i], vsapi->getWritePtr(dst, vs_plane), vsapi->getStride(dst, vs_plane));
+    }
+
+    for (int i = 0; i < num_planes; i++)
+        ok &= vspl_download_finish(p, i);
+
     if (!ok) {
         vsapi->logMessage(mtCritical, "placebo.Deband: Failed downloading data from the GPU!", core);
     }
@@ -151,77 +182,47 @@ static const VSFrame *VS_CC VSPlaceboDebandGetFrame(int n, int activationReason,
         int iw = vsapi->getFrameWidth(frame, 0);
 
         const VSVideoFormat srcFmt = dbd_data->vi->format;
-        VSFrame *dst = vsapi->newVideoFrame(&srcFmt, iw, ih, frame, core);
-
-        struct pl_color_repr repr = {
-            .bits = {
-                .sample_depth = dbd_data->vi->format.bitsPerSample,
-                .color_depth = dbd_data->vi->format.bitsPerSample,
-                .bit_shift = 0
-            },
-            .sys = PL_COLOR_SYSTEM_UNKNOWN,
-        };
-
-        struct pl_frame src_img = {
-            .repr       = repr,
-            .color      = pl_color_space_unknown,
-        };
-        struct pl_frame dst_img = src_img;
-
-        pthread_mutex_lock(&dbd_data->lock); // libplacebo isn’t thread-safe
-
-        struct priv *p = dbd_data->vf;
-
+        const VSVideoFormat *dstFmt = &dbd_data->vi_out.format;
+        const bool convert = dstFmt->bitsPerSample != srcFmt.bitsPerSample || dstFmt->sampleType != srcFmt.sampleType;
         int numPlanes = srcFmt.numPlanes;
-        int plane_idx = 0;
+        int num_processed = 0;
+
+        // Untouched planes are referenced from the source instead of copied
+        const VSFrame *plane_src[3] = {};
+        int plane_idx[3] = {0, 1, 2};
 
         struct pl_plane_data data[3] = {};
-        for (unsigned int i = 0; i < numPlanes; ++i) {
-            bool copied = !((1u << i) & dbd_data->planes);
-
-            if (copied) {
-                vsh_bitblt(vsapi->getWritePtr(dst, i), vsapi->getStride(dst, i),
-                          vsapi->getWritePtr((VSFrame *) frame, i),
-                          vsapi->getStride(frame, i),
-                          vsapi->getFrameWidth(dst, i) * dbd_data->vi->format.bytesPerSample,
-                          vsapi->getFrameHeight(dst, i));
-            } else {
-                src_img.num_planes += 1;
-
-                data[plane_idx] = (struct pl_plane_data) {
-                    .type = srcFmt.sampleType == stInteger ? PL_FMT_UNORM : PL_FMT_FLOAT,
-                    .width = vsapi->getFrameWidth(frame, i),
-                    .height = vsapi->getFrameHeight(frame, i),
-                    .pixel_stride = srcFmt.bytesPerSample,
-                    .row_stride = vsapi->getStride(frame, i),
-                    .pixels = vsapi->getReadPtr((VSFrame *) frame, i),
-                    .component_size[0] = srcFmt.bitsPerSample,
-                    .component_pad[0] = 0,
-                    .component_map[0] = i,
-                };
-
-                if (vspl_deband_reconfig(dbd_data, dst, core, vsapi, plane_idx, &data[plane_idx])) {
-                    vspl_deband_upload_plane(dbd_data, core, vsapi, plane_idx, &data[plane_idx], &src_img.planes[plane_idx]);
-                }
-
-                // Create a plane for target
-                dst_img.planes[plane_idx] = (struct pl_plane) {
-                    .texture = p->tex_out[plane_idx],
-                    .components = p->tex_out[plane_idx]->params.format->num_components,
-                    .component_mapping[0] = i,
-                };
-
-                plane_idx += 1;
+        for (int i = 0; i < numPlanes; ++i) {
+            if (!convert && !((1u << i) & dbd_data->planes)) {
+                plane_src[i] = frame;
+                continue;
             }
+
+            data[num_processed++] = (struct pl_plane_data) {
+                .type = srcFmt.sampleType == stInteger ? PL_FMT_UNORM : PL_FMT_FLOAT,
+                .width = vsapi->getFrameWidth(frame, i),
+                .height = vsapi->getFrameHeight(frame, i),
+                .pixel_stride = srcFmt.bytesPerSample,
+                .row_stride = vsapi->getStride(frame, i),
+                .pixels = vsapi->getReadPtr(frame, i),
+                .component_size[0] = srcFmt.bitsPerSample,
+                .component_pad[0] = 0,
+                .component_map[0] = i,
+            };
         }
 
-        dst_img.num_planes = src_img.num_planes;
+        if (!num_processed)
+            return frame;
 
-        if (vspl_deband_do_image(dbd_data, &src_img, &dst_img, core, vsapi)) {
-            vspl_deband_download_planes(dbd_data, core, vsapi, dst, data, &dst_img);
+        VSFrame *dst = vsapi->newVideoFrame2(dstFmt, iw, ih, plane_src, plane_idx, frame, core);
+
+        struct priv *p = vspl_pool_acquire(dbd_data->pool); // libplacebo isn’t thread-safe
+
+        if (vspl_deband_reconfig(p, data, num_processed, dstFmt, core, vsapi)) {
+            vspl_deband_filter(p, dbd_data, n, dst, data, num_processed, core, vsapi);
         }
 
-        pthread_mutex_unlock(&dbd_data->lock);
+        vspl_pool_release(dbd_data->pool, p);
 
         vsapi->freeFrame(frame);
         return dst;
@@ -233,11 +234,9 @@ static const VSFrame *VS_CC VSPlaceboDebandGetFrame(int n, int activationReason,
 static void VS_CC VSPlaceboDebandFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     DebandData *d = (DebandData *) instanceData;
     vsapi->freeNode(d->node);
-    VSPlaceboUninit(d->vf);
+    vspl_pool_destroy(&d->pool);
     free((void *) d->render_params->dither_params);
-    free((void *) d->render_params->deband_params);
     free(d->render_params);
-    pthread_mutex_destroy(&d->lock);
     free(d);
 }
 
@@ -247,12 +246,6 @@ void VS_CC VSPlaceboDebandCreate(const VSMap *in, VSMap *out, void *userData, VS
     int err;
     enum pl_log_level log_level;
 
-    if (pthread_mutex_init(&d.lock, NULL) != 0)
-    {
-        vsapi->mapSetError(out, "placebo.Deband: mutex init failed!");
-        return;
-    }
-
     log_level = vsapi->mapGetInt(in, "log_level", 0, &err);
     if (err)
         log_level = PL_LOG_ERR;
@@ -263,23 +256,73 @@ void VS_CC VSPlaceboDebandCreate(const VSMap *in, VSMap *out, void *userData, VS
     if ((d.vi->format.bitsPerSample != 8 && d.vi->format.bitsPerSample != 16 && d.vi->format.bitsPerSample != 32)) {
         vsapi->mapSetError(out, "placebo.Deband: Input bitdepth should be 8, 16 (Integer) or 32 (Float)!");
         vsapi->freeNode(d.node);
+        return;
     }
 
-    d.vf = VSPlaceboInit(log_level);
+    d.vi_out = *d.vi;
 
-    d.dither = vsapi->mapGetInt(in, "dither", 0, &err) && d.vi->format.bitsPerSample == 8;
+    int bits = vsapi->mapGetIntSaturated(in, "bits", 0, &err);
+    if (!err) {
+        if (bits < 8 || bits > 16) {
+            vsapi->mapSetError(out, "placebo.Deband: bits must be between 8 and 16!");
+            vsapi->freeNode(d.node);
+            return;
+        }
+
+        if (!vsapi->queryVideoFormat(&d.vi_out.format, d.vi->format.colorFamily, stInteger, bits,
+                                     d.vi->format.subSamplingW, d.vi->format.subSamplingH, core)) {
+            vsapi->mapSetError(out, "placebo.Deband: Invalid output format!");
+            vsapi->freeNode(d.node);
+            return;
+        }
+    }
+
+    static const char *const per_plane_params[] = {"iterations", "threshold", "radius", "grain"};
+    for (int i = 0; i < 4; i++) {
+        if (vsapi->mapNumElements(in, per_plane_params[i]) > d.vi->format.numPlanes) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "placebo.Deband: More values for `%s` than the clip has planes!", per_plane_params[i]);
+            vsapi->mapSetError(out, msg);
+            vsapi->freeNode(d.node);
+            return;
+        }
+    }
+
+    int num_contexts = vsapi->mapGetIntSaturated(in, "num_contexts", 0, &err);
+    if (err)
+        num_contexts = 1;
+
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS) {
+        vsapi->mapSetError(out, "placebo.Deband: num_contexts must be between 1 and " VSPL_STR(VSPL_MAX_CONTEXTS) "!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.pool = vspl_pool_create(num_contexts, log_level);
+    if (!d.pool) {
+        vsapi->mapSetError(out, "placebo.Deband: Failed initializing GPU contexts!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    // Only outputs below 16 bit lose precision
+    const bool out_low_depth = d.vi_out.format.sampleType == stInteger && d.vi_out.format.bitsPerSample < 16;
+    d.dither = vsapi->mapGetInt(in, "dither", 0, &err) && out_low_depth;
     if (err)
-        d.dither = d.vi->format.bitsPerSample == 8;
+        d.dither = out_low_depth;
 
     d.planes = (unsigned int) vsapi->mapGetInt(in, "planes", 0, &err);
     if (err)
         d.planes = 1u;
 
-    struct pl_deband_params *debandParams = malloc(sizeof(struct pl_deband_params));
-    *debandParams = pl_deband_default_params;
+    for (int i = 0; i < 3; i++)
+        d.deband_params[i] = pl_deband_default_params;
 
-#define DB_PARAM(par, type) debandParams->par = vsapi->mapGet##type(in, #par, 0, &err); \
-        if (err) debandParams->par = pl_deband_default_params.par;
+    // One value per plane, missing ones repeat the last given
+#define DB_PARAM(par, type) for (int i = 0; i < 3; i++) { \
+            d.deband_params[i].par = vsapi->mapGet##type(in, #par, i, &err); \
+            if (err) d.deband_params[i].par = i ? d.deband_params[i - 1].par : pl_deband_default_params.par; \
+        }
 
     DB_PARAM(iterations, Int)
     DB_PARAM(threshold, Float)
@@ -297,10 +340,8 @@ void VS_CC VSPlaceboDebandCreate(const VSMap *in, VSMap *out, void *userData, VS
     *render_params = pl_render_fast_params;
 
     render_params->dither_params = plDitherParams;
-    render_params->deband_params = debandParams;
 
     d.render_params = render_params;
-    d.frame_index = 0;
 
     data = malloc(sizeof(d));
     *data = d;
@@ -310,7 +351,7 @@ void VS_CC VSPlaceboDebandCreate(const VSMap *in, VSMap *out, void *userData, VS
     vsapi->createVideoFilter(
         out,
         "Deband",
-        d.vi,
+        &d.vi_out,
         VSPlaceboDebandGetFrame,
         VSPlaceboDebandFree,
         fmParallel,
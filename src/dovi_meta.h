@@ -1,21 +1,98 @@
 #include "config_vsplacebo.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <libplacebo/colorspace.h>
 
+#include "vs-placebo.h"
+
 #ifdef HAVE_DOVI
 #include <libdovi/rpu_parser.h>
 
-static struct pl_dovi_metadata *create_dovi_meta(DoviRpuOpaque *rpu,
-                                                const DoviRpuDataHeader *hdr)
+#define VSPL_DOVI_CACHE_SIZE 16
+
+// How many frames back an RPU's deferred metadata is looked for
+#define VSPL_DOVI_MAX_PREV 8
+
+/** Everything Tonemap needs from one RPU, parsed once. */
+struct vspl_dovi_rpu {
+    struct pl_dovi_metadata meta;
+    uint8_t profile;
+
+    // Parts of `meta` that have to be taken from the previous RPU
+    bool prev_mapping;
+    bool prev_dm;
+
+    bool has_dm;
+    float source_min_pq;
+    float source_max_pq;
+
+    bool has_l1;
+    float l1_avg_pq;
+    float l1_max_pq;
+
+    bool has_l6;
+    uint16_t max_cll;
+    uint16_t max_fall;
+};
+
+struct vspl_dovi_cache_entry {
+    uint64_t hash;
+    uint64_t last_used; // 0 if unused
+    size_t size;
+    uint8_t *data;
+    struct vspl_dovi_rpu rpu;
+};
+
+/** LRU cache of parsed RPUs, keyed by their bytes. Identical RPUs repeat over a whole shot. */
+struct vspl_dovi_cache {
+    struct vspl_dovi_cache_entry entries[VSPL_DOVI_CACHE_SIZE];
+    uint64_t clock;
+    pthread_mutex_t lock;
+};
+
+static struct vspl_dovi_cache *vspl_dovi_cache_create(void)
+{
+    struct vspl_dovi_cache *cache = calloc(1, sizeof(*cache));
+    if (cache)
+        pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+static void vspl_dovi_cache_destroy(struct vspl_dovi_cache **cache)
 {
-    static struct pl_dovi_metadata dovi_meta; // persist state
-    if (hdr->use_prev_vdr_rpu_flag)
-        goto done;
+    if (!*cache)
+        return;
 
-    const DoviRpuDataMapping *mapping = dovi_rpu_get_data_mapping(rpu);
-    if (!mapping)
-        goto skip_mapping;
+    for (int i = 0; i < VSPL_DOVI_CACHE_SIZE; i++)
+        free((*cache)->entries[i].data);
 
+    pthread_mutex_destroy(&(*cache)->lock);
+    free(*cache);
+    *cache = NULL;
+}
+
+static uint64_t vspl_dovi_hash(const uint8_t *data, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static void vspl_dovi_parse_mapping(struct pl_dovi_metadata *dovi_meta, const DoviRpuDataMapping *mapping,
+                                    const DoviRpuDataHeader *hdr)
+{
     const uint8_t bits = hdr->bl_bit_depth_minus8 + 8;
     const float scale = 1.0f / (1 << hdr->coefficient_log2_denom);
 
@@ -23,7 +100,7 @@ static struct pl_dovi_metadata *create_dovi_meta(DoviRpuOpaque *rpu,
     for (int c = 0; c < 3; c++) {
         const DoviReshapingCurve curve = mapping->curves[c];
 
-        struct pl_reshape_data *cmp = &dovi_meta.comp[c];
+        struct pl_reshape_data *cmp = &dovi_meta->comp[c];
         cmp->num_pivots = curve.pivots.len;
         memset(cmp->method, curve.mapping_idc, sizeof(cmp->method));
 
@@ -64,7 +141,7 @@ static struct pl_dovi_metadata *create_dovi_meta(DoviRpuOpaque *rpu,
     }
 #else
     for (int c = 0; c < 3; c++) {
-        struct pl_reshape_data *cmp = &dovi_meta.comp[c];
+        struct pl_reshape_data *cmp = &dovi_meta->comp[c];
         uint16_t pivot = 0;
         cmp->num_pivots = hdr->num_pivots_minus_2[c] + 2;
         for (int pivot_idx = 0; pivot_idx < cmp->num_pivots; pivot_idx++) {
@@ -101,36 +178,156 @@ static struct pl_dovi_metadata *create_dovi_meta(DoviRpuOpaque *rpu,
         }
     }
 #endif
+}
 
-    dovi_rpu_free_data_mapping(mapping);
-skip_mapping:
+/** Returns false if `data` isn't a valid RPU. */
+static bool vspl_dovi_parse(const uint8_t *data, size_t size, struct vspl_dovi_rpu *out)
+{
+    *out = (struct vspl_dovi_rpu) {0};
 
-    if (hdr->vdr_dm_metadata_present_flag) {
-        const DoviVdrDmData *dm_data = dovi_rpu_get_vdr_dm_data(rpu);
-        if (!dm_data)
-            goto done;
+    DoviRpuOpaque *rpu = dovi_parse_unspec62_nalu(data, size);
+    const DoviRpuDataHeader *hdr = dovi_rpu_get_header(rpu);
+    if (!hdr) {
+        fprintf(stderr, "Failed parsing RPU: %s\n", dovi_rpu_get_error(rpu));
+        dovi_rpu_free(rpu);
+        return false;
+    }
+
+    out->profile = hdr->guessed_profile;
+
+    const DoviRpuDataMapping *mapping = hdr->use_prev_vdr_rpu_flag ? NULL : dovi_rpu_get_data_mapping(rpu);
+    if (mapping) {
+        vspl_dovi_parse_mapping(&out->meta, mapping, hdr);
+        dovi_rpu_free_data_mapping(mapping);
+    } else {
+        out->prev_mapping = true;
+    }
 
+    const DoviVdrDmData *dm_data = hdr->vdr_dm_metadata_present_flag ? dovi_rpu_get_vdr_dm_data(rpu) : NULL;
+    if (dm_data) {
         const uint32_t *off = &dm_data->ycc_to_rgb_offset0;
         for (int i = 0; i < 3; i++)
-            dovi_meta.nonlinear_offset[i] = (float) off[i] / (1 << 28);
+            out->meta.nonlinear_offset[i] = (float) off[i] / (1 << 28);
 
         const int16_t *src = &dm_data->ycc_to_rgb_coef0;
-        float *dst = &dovi_meta.nonlinear.m[0][0];
+        float *dst = &out->meta.nonlinear.m[0][0];
         for (int i = 0; i < 9; i++)
             dst[i] = src[i] / 8192.0;
 
         src = &dm_data->rgb_to_lms_coef0;
-        dst = &dovi_meta.linear.m[0][0];
+        dst = &out->meta.linear.m[0][0];
         for (int i = 0; i < 9; i++)
             dst[i] = src[i] / 16384.0;
 
+        out->has_dm = true;
+        out->source_min_pq = dm_data->source_min_pq / 4095.0f;
+        out->source_max_pq = dm_data->source_max_pq / 4095.0f;
+
+        if (dm_data->dm_data.level1) {
+            out->has_l1 = true;
+            out->l1_avg_pq = dm_data->dm_data.level1->avg_pq / 4095.0f;
+            out->l1_max_pq = dm_data->dm_data.level1->max_pq / 4095.0f;
+        }
+
+        if (dm_data->dm_data.level6) {
+            out->has_l6 = true;
+            out->max_cll = dm_data->dm_data.level6->max_content_light_level;
+            out->max_fall = dm_data->dm_data.level6->max_frame_average_light_level;
+        }
+
         dovi_rpu_free_vdr_dm_data(dm_data);
+    } else {
+        out->prev_dm = true;
+    }
+
+    dovi_rpu_free_header(hdr);
+    dovi_rpu_free(rpu);
+    return true;
+}
+
+/** Parses `data` into `out`, or copies it from the cache if the same RPU was seen recently. */
+static bool vspl_dovi_cache_get(struct vspl_dovi_cache *cache, const uint8_t *data, size_t size,
+                                struct vspl_dovi_rpu *out)
+{
+    if (!cache)
+        return vspl_dovi_parse(data, size, out);
+
+    const uint64_t hash = vspl_dovi_hash(data, size);
+
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < VSPL_DOVI_CACHE_SIZE; i++) {
+        struct vspl_dovi_cache_entry *e = &cache->entries[i];
+        if (e->last_used && e->hash == hash && e->size == size && !memcmp(e->data, data, size)) {
+            e->last_used = ++cache->clock;
+            memcpy(out, &e->rpu, sizeof(*out));
+            pthread_mutex_unlock(&cache->lock);
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Parse outside the lock, a concurrent miss on the same RPU only costs a duplicate parse
+    if (!vspl_dovi_parse(data, size, out))
+        return false;
+
+    uint8_t *copy = malloc(size);
+    if (!copy)
+        return true;
+    memcpy(copy, data, size);
+
+    pthread_mutex_lock(&cache->lock);
+    struct vspl_dovi_cache_entry *lru = &cache->entries[0];
+    for (int i = 1; i < VSPL_DOVI_CACHE_SIZE; i++) {
+        if (cache->entries[i].last_used < lru->last_used)
+            lru = &cache->entries[i];
+    }
+
+    free(lru->data);
+    *lru = (struct vspl_dovi_cache_entry) {
+        .hash = hash,
+        .last_used = ++cache->clock,
+        .size = size,
+        .data = copy,
+    };
+    memcpy(&lru->rpu, out, sizeof(*out));
+    pthread_mutex_unlock(&cache->lock);
+
+    return true;
+}
+
+/**
+ * Fills in what `rpu` still defers with what `prev` carries itself. Called
+ * on ever older RPUs, so parts `prev` defers too are left for the next one.
+ * Returns true once nothing is deferred anymore.
+ */
+static bool vspl_dovi_inherit(struct vspl_dovi_rpu *rpu, const struct vspl_dovi_rpu *prev)
+{
+    if (rpu->prev_mapping && !prev->prev_mapping) {
+        memcpy(rpu->meta.comp, prev->meta.comp, sizeof(rpu->meta.comp));
+        rpu->prev_mapping = false;
+    }
+
+    if (rpu->prev_dm && !prev->prev_dm) {
+        memcpy(rpu->meta.nonlinear_offset, prev->meta.nonlinear_offset, sizeof(rpu->meta.nonlinear_offset));
+        rpu->meta.nonlinear = prev->meta.nonlinear;
+        rpu->meta.linear = prev->meta.linear;
+
+        rpu->has_dm = prev->has_dm;
+        rpu->source_min_pq = prev->source_min_pq;
+        rpu->source_max_pq = prev->source_max_pq;
+
+        rpu->has_l1 = prev->has_l1;
+        rpu->l1_avg_pq = prev->l1_avg_pq;
+        rpu->l1_max_pq = prev->l1_max_pq;
+
+        rpu->has_l6 = prev->has_l6;
+        rpu->max_cll = prev->max_cll;
+        rpu->max_fall = prev->max_fall;
+
+        rpu->prev_dm = false;
     }
 
-done: ;
-    struct pl_dovi_metadata *ret = malloc(sizeof(dovi_meta));
-    memcpy(ret, &dovi_meta, sizeof(dovi_meta));
-    return ret;
+    return !rpu->prev_mapping && !rpu->prev_dm;
 }
 
 #endif // HAVE_DOVI
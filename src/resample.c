@@ -14,7 +14,7 @@
 typedef struct {
     VSNode *node;
     const VSVideoInfo *vi;
-    void *vf;
+    struct vspl_pool *pool;
     int width;
     int height;
 
@@ -26,64 +26,55 @@ typedef struct {
     float src_x;
     float src_y;
     struct pl_sample_filter_params *sampleParams;
-    pl_shader_obj lut;
     struct pl_sigmoid_params *sigmoid_params;
     enum pl_color_transfer trc;
     bool linear;
 
     /** Minimum luminance. */
     float min_luma;
-
-    pthread_mutex_t lock;
 } ResampleData;
 
-bool vspl_resample_do_plane(
-    struct priv *p,
-    void *data,
-    int w,
-    int h,
-    float src_width,
-    float src_height,
-    VSCore *core,
-    const VSAPI *vsapi,
-    float sx,
-    float sy
-)
+/**
+ * Linearizes and/or sigmoidizes the uploaded plane `idx` into tex_tmp[idx].
+ * Returns the texture the scalers should sample from, which is tex_in[idx]
+ * itself when there is nothing to do, or NULL on failure.
+ */
+static pl_tex vspl_resample_prepass(struct priv *p, ResampleData *d, int idx, VSCore *core, const VSAPI *vsapi)
 {
-    ResampleData *d = (ResampleData*) data;
-    pl_shader sh = pl_dispatch_begin(p->dp);
-    pl_tex sample_fbo = NULL;
-    pl_tex sep_fbo = NULL;
+    //
+    // linearization and sigmoidization
+    //
+    // The scalers filter raw texels, so these can't be folded into the
+    // sampling shaders and need a pass of their own. Without them, the
+    // scalers sample the uploaded texture directly.
+    //
 
-    struct pl_sample_filter_params sampleFilterParams = *d->sampleParams;
-    sampleFilterParams.lut = &d->lut;
+    pl_tex tex = p->tex_in[idx];
+    if (!d->linear && !d->sigmoid_params)
+        return tex;
 
     struct pl_color_space *color = pl_color_space(
         .transfer = d->trc,
         .hdr.min_luma = d->min_luma,
     );
 
-    struct pl_sample_src *src = pl_sample_src(
-        .tex = p->tex_in[0]
-    );
-
-    //
-    // linearization and sigmoidization
-    //
-
-    pl_shader ish = pl_dispatch_begin(p->dp);
     struct pl_tex_params *tex_params = pl_tex_params(
-        .w = src->tex->params.w,
-        .h = src->tex->params.h,
+        .w = tex->params.w,
+        .h = tex->params.h,
         .renderable = true,
         .sampleable = true,
-        .format = src->tex->params.format
+        .format = tex->params.format
     );
 
-    if (!pl_tex_recreate(p->gpu, &sample_fbo, tex_params))
+    // Intermediates persist in the context, so steady state allocates nothing
+    pl_tex *sample_fbo = &p->tex_tmp[idx];
+    if (!vspl_tex_recreate(p, sample_fbo, tex_params)) {
         vsapi->logMessage(mtCritical, "failed creating intermediate color texture!\n", core);
+        return NULL;
+    }
 
-    pl_shader_sample_direct(ish, src);
+    pl_shader ish = pl_dispatch_begin(p->dp);
+    pl_shader_sample_direct(ish, pl_sample_src(.tex = tex));
     if (d->linear)
         pl_shader_linearize(ish, color);
 
@@ -91,13 +82,47 @@ bool vspl_resample_do_plane(
         pl_shader_sigmoidize(ish, d->sigmoid_params);
 
     if (!pl_dispatch_finish(p->dp, pl_dispatch_params(
-        .target = sample_fbo,
+        .target = *sample_fbo,
         .shader = &ish
     ))) {
         vsapi->logMessage(mtCritical, "Failed linearizing/sigmoidizing! \n", core);
-        return false;
+        return NULL;
     }
 
+    return *sample_fbo;
+}
+
+/** Scales the prepassed plane `src_tex` into tex_out[idx]. */
+bool vspl_resample_do_plane(
+    struct priv *p,
+    void *data,
+    pl_tex src_tex,
+    int idx,
+    int w,
+    int h,
+    float src_width,
+    float src_height,
+    VSCore *core,
+    const VSAPI *vsapi,
+    float sx,
+    float sy
+)
+{
+    ResampleData *d = (ResampleData*) data;
+    pl_shader sh = pl_dispatch_begin(p->dp);
+
+    struct pl_sample_filter_params sampleFilterParams = *d->sampleParams;
+    sampleFilterParams.lut = &p->lut;
+
+    struct pl_color_space *color = pl_color_space(
+        .transfer = d->trc,
+        .hdr.min_luma = d->min_luma,
+    );
+
+    struct pl_sample_src *src = pl_sample_src(
+        .tex = src_tex
+    );
+
     //
     // sampling
     //
@@ -108,7 +133,6 @@ bool vspl_resample_do_plane(
         src_width + sx,
         src_height + sy,
     };
-    src->tex = sample_fbo;
     src->rect = rect;
     src->new_h = h;
     src->new_w = w;
@@ -139,18 +163,20 @@ bool vspl_resample_do_plane(
             .format = src->tex->params.format,
         );
 
-        if (!pl_tex_recreate(p->gpu, &sep_fbo, tex_params))
+        pl_tex *sep_fbo = &p->tex_sep;
+        if (!vspl_tex_recreate(p, sep_fbo, tex_params))
             vsapi->logMessage(mtCritical, "failed creating intermediate texture!\n", core);
 
         if (!pl_dispatch_finish(p->dp, pl_dispatch_params (
-            .target = sep_fbo,
+            .target = *sep_fbo,
             .shader = &tsh
         ))) {
             vsapi->logMessage(mtCritical, "Failed rendering vertical pass! \n", core);
+            pl_dispatch_abort(p->dp, &sh);
             return false;
         }
 
-        src2.tex = sep_fbo;
+        src2.tex = *sep_fbo;
         src2.scale = 1.0;
         if (!pl_shader_sample_ortho2(sh, &src2, &sampleFilterParams))
             vsapi->logMessage(mtCritical, "Failed dispatching horizontal pass! \n", core);
@@ -163,15 +189,11 @@ bool vspl_resample_do_plane(
         pl_shader_delinearize(sh, color);
 
 
-    bool ok = pl_dispatch_finish(p->dp, pl_dispatch_params(
-        .target = p->tex_out[0],
+    return pl_dispatch_finish(p->dp, pl_dispatch_params(
+        .target = p->tex_out[idx],
         .shader = &sh
     ));
 
-    pl_tex_destroy(p->gpu, &sep_fbo);
-    pl_tex_destroy(p->gpu, &sample_fbo);
-    return ok;
-
 //    struct pl_plane plane = (struct pl_plane) {.texture = p->tex_in[0], .components = 1, .component_mapping[0] = 0};
 //
 //    struct pl_color_repr crpr = {.bits = {.sample_depth = d->vi->format->bytesPerSample * 8, .color_depth =
@@ -192,47 +214,51 @@ bool vspl_resample_do_plane(
 
 }
 
-bool vspl_resample_reconfig(void *priv, struct pl_plane_data *data, int w, int h, VSCore *core, const VSAPI *vsapi)
+/** Uploads plane `idx` into tex_in[idx]. */
+bool vspl_resample_upload(struct priv *p, struct pl_plane_data *data, int idx, VSCore *core, const VSAPI *vsapi)
 {
-    struct priv *p = priv;
-
     pl_fmt fmt = pl_plane_find_fmt(p->gpu, NULL, data);
     if (!fmt) {
         vsapi->logMessage(mtCritical, "Failed configuring filter: no good texture format!\n", core);
         return false;
     }
 
-    bool ok = true;
-    ok &= pl_tex_recreate(p->gpu, &p->tex_in[0], pl_tex_params(
+    if (!vspl_tex_recreate(p, &p->tex_in[idx], pl_tex_params(
         .w = data->width,
         .h = data->height,
         .format = fmt,
         .sampleable = true,
         .host_writable = true,
-    ));
+    ))) {
+        vsapi->logMessage(mtCritical, "Failed creating GPU textures!\n", core);
+        return false;
+    }
 
-    ok &= pl_tex_recreate(p->gpu, &p->tex_out[0], pl_tex_params(
-        .w = w,
-        .h = h,
-        .format = fmt,
-        .renderable = true,
-        .host_readable = true,
-        .storable = true,
-    ));
+    vspl_stage_plane(p, idx, data);
 
-    if (!ok) {
-        vsapi->logMessage(mtCritical, "Failed creating GPU textures!\n", core);
+    if (!pl_tex_upload(p->gpu, pl_tex_transfer_params(
+        .tex = p->tex_in[idx],
+        .row_pitch = (data->row_stride / data->pixel_stride) * fmt->texel_size,
+        .ptr = (void *) data->pixels,
+        .buf = data->buf,
+        .buf_offset = data->buf_offset,
+    ))) {
+        vsapi->logMessage(mtCritical, "Failed uploading data to the GPU!\n", core);
         return false;
     }
 
     return true;
 }
 
+/**
+ * Scales plane `idx` into `dst` and starts reading it back. The caller waits
+ * for the download with vspl_download_finish().
+ */
 bool vspl_resample_filter(
-    void *priv,
+    struct priv *p,
+    ResampleData *d,
+    pl_tex src_tex,
     VSFrame *dst,
-    struct pl_plane_data *src,
-    void *d,
     int w,
     int h,
     float src_width,
@@ -244,40 +270,26 @@ bool vspl_resample_filter(
     int planeIdx
 )
 {
-    struct priv *p = priv;
-
-    pl_fmt in_fmt = p->tex_in[0]->params.format;
-    pl_fmt out_fmt = p->tex_out[0]->params.format;
-
-    // Upload planes
-    bool ok = true;
-    ok &= pl_tex_upload(p->gpu, pl_tex_transfer_params(
-        .tex = p->tex_in[0],
-        .row_pitch = (src->row_stride / src->pixel_stride) * in_fmt->texel_size,
-        .ptr = (void *) src->pixels,
-    ));
-
-    if (!ok) {
-        vsapi->logMessage(mtCritical, "Failed uploading data to the GPU!\n", core);
+    if (!vspl_tex_recreate(p, &p->tex_out[planeIdx], pl_tex_params(
+        .w = w,
+        .h = h,
+        .format = src_tex->params.format,
+        .renderable = true,
+        .host_readable = true,
+        .storable = true,
+    ))) {
+        vsapi->logMessage(mtCritical, "Failed creating GPU textures!\n", core);
         return false;
     }
+
     // Process plane
-    if (!vspl_resample_do_plane(p, d, w, h, src_width, src_height, core, vsapi, sx, sy)) {
+    if (!vspl_resample_do_plane(p, d, src_tex, planeIdx, w, h, src_width, src_height, core, vsapi, sx, sy)) {
         vsapi->logMessage(mtCritical, "Failed processing planes!\n", core);
         return false;
     }
 
-    uint8_t *dst_ptr = vsapi->getWritePtr(dst, planeIdx);
-    int dst_row_pitch = (vsapi->getStride(dst, planeIdx) / src->pixel_stride) * out_fmt->texel_size;
-
-    // Download planes
-    ok = pl_tex_download(p->gpu, pl_tex_transfer_params(
-        .tex = p->tex_out[0],
-        .row_pitch = dst_row_pitch,
-        .ptr = (void *) dst_ptr,
-    ));
-
-    if (!ok) {
+    // Download planes; the caller waits for all planes of the frame at once
+    if (!vspl_download_start(p, planeIdx, p->tex_out[planeIdx], vsapi->getWritePtr(dst, planeIdx), vsapi->getStride(dst, planeIdx))) {
         vsapi->logMessage(mtCritical, "Failed downloading data from the GPU!\n", core);
         return false;
     }
@@ -324,34 +336,52 @@ void vspl_propagate_sar(
     }
 }
 
-static const VSFrame *VS_CC VSPlaceboResampleGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    ResampleData *d = (ResampleData *) instanceData;
-
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrame *frame = vsapi->getFrameFilter(n, d->node, frameCtx);
-
-        const VSVideoFormat *srcFmt = vsapi->getVideoFrameFormat(frame);
-        const float subsampling_w = 1 << srcFmt->subSamplingW;
-        const float subsampling_h = 1 << srcFmt->subSamplingH;
+/**
+ * Uploads and prepasses every plane of `frame` once, then scales it to each
+ * of the `num_dst` output frames. The planes of one output are read back
+ * together, with a single wait before the next output reuses tex_out.
+ */
+static void vspl_resample_frame(
+    ResampleData *d,
+    const VSFrame *frame,
+    VSFrame **dst,
+    int num_dst,
+    VSCore *core,
+    const VSAPI *vsapi
+)
+{
+    const VSVideoFormat *srcFmt = vsapi->getVideoFrameFormat(frame);
+    const float subsampling_w = 1 << srcFmt->subSamplingW;
+    const float subsampling_h = 1 << srcFmt->subSamplingH;
+
+    struct priv *p = vspl_pool_acquire(d->pool);
+    pl_tex src[MAX_PLANES] = {0};
+
+    for (unsigned int i = 0; i < srcFmt->numPlanes; i++) {
+        struct pl_plane_data plane = {
+            .type = srcFmt->sampleType == stInteger ? PL_FMT_UNORM : PL_FMT_FLOAT,
+            .width = vsapi->getFrameWidth(frame, i),
+            .height = vsapi->getFrameHeight(frame, i),
+            .pixel_stride = srcFmt->bytesPerSample,
+            .row_stride = vsapi->getStride(frame, i),
+            .pixels = vsapi->getReadPtr((VSFrame *) frame, i),
+            .component_size[0] = srcFmt->bitsPerSample,
+            .component_pad[0] = 0,
+            .component_map[0] = 0,
+        };
+
+        if (vspl_resample_upload(p, &plane, i, core, vsapi))
+            src[i] = vspl_resample_prepass(p, d, i, core, vsapi);
+    }
 
-        VSFrame *dst = vsapi->newVideoFrame(srcFmt, d->width, d->height, frame, core);
+    for (int k = 0; k < num_dst; k++) {
+        bool started[MAX_PLANES] = {0};
 
         for (unsigned int i = 0; i < srcFmt->numPlanes; i++) {
-            struct pl_plane_data plane = {
-                .type = srcFmt->sampleType == stInteger ? PL_FMT_UNORM : PL_FMT_FLOAT,
-                .width = vsapi->getFrameWidth(frame, i),
-                .height = vsapi->getFrameHeight(frame, i),
-                .pixel_stride = srcFmt->bytesPerSample,
-                .row_stride = vsapi->getStride(frame, i),
-                .pixels = vsapi->getReadPtr((VSFrame *) frame, i),
-                .component_size[0] = srcFmt->bitsPerSample,
-                .component_pad[0] = 0,
-                .component_map[0] = 0,
-            };
-
-            int w = vsapi->getFrameWidth(dst, i), h = vsapi->getFrameHeight(dst, i);
+            if (!src[i])
+                continue;
+
+            int w = vsapi->getFrameWidth(dst[k], i), h = vsapi->getFrameHeight(dst[k], i);
 
             // FIXME: support other chroma locations as well.
             const float subsampling_shift_w = (0.5f * (1.0f - (float) w / (float) d->vi->width)) / subsampling_w;
@@ -364,28 +394,49 @@ static const VSFrame *VS_CC VSPlaceboResampleGetFrame(int n, int activationReaso
             const float src_w = shift ? d->src_width / subsampling_w : d->src_width;
             const float src_h = shift ? d->src_height / subsampling_h : d->src_height;
 
-            pthread_mutex_lock(&d->lock);
-
-            if (vspl_resample_reconfig(d->vf, &plane, w, h, core, vsapi)) {
-                vspl_resample_filter(d->vf, dst, &plane, d, w, h, src_w, src_h, sx, sy, core, vsapi, i);
-            }
+            started[i] = vspl_resample_filter(p, d, src[i], dst[k], w, h, src_w, src_h, sx, sy, core, vsapi, i);
+        }
 
-            pthread_mutex_unlock(&d->lock);
+        for (unsigned int i = 0; i < srcFmt->numPlanes; i++) {
+            if (started[i] && !vspl_download_finish(p, i))
+                vsapi->logMessage(mtCritical, "Failed downloading data from the GPU!\n", core);
         }
+    }
 
-        const VSMap *src_props = vsapi->getFramePropertiesRO(frame);
-        VSMap *dst_props = vsapi->getFramePropertiesRW(dst);
-        vspl_propagate_sar(
-            src_props,
-            dst_props,
-            vsapi->getFrameWidth(frame, 0),
-            vsapi->getFrameHeight(frame, 0),
-            d->src_width,
-            d->src_height,
-            d->width,
-            d->height,
-            vsapi
-        );
+    vspl_pool_release(d->pool, p);
+}
+
+static VSFrame *vspl_resample_new_frame(ResampleData *d, const VSFrame *frame, int width, int height, VSCore *core, const VSAPI *vsapi)
+{
+    VSFrame *dst = vsapi->newVideoFrame(vsapi->getVideoFrameFormat(frame), width, height, frame, core);
+
+    const VSMap *src_props = vsapi->getFramePropertiesRO(frame);
+    VSMap *dst_props = vsapi->getFramePropertiesRW(dst);
+    vspl_propagate_sar(
+        src_props,
+        dst_props,
+        vsapi->getFrameWidth(frame, 0),
+        vsapi->getFrameHeight(frame, 0),
+        d->src_width,
+        d->src_height,
+        width,
+        height,
+        vsapi
+    );
+
+    return dst;
+}
+
+static const VSFrame *VS_CC VSPlaceboResampleGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ResampleData *d = (ResampleData *) instanceData;
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *frame = vsapi->getFrameFilter(n, d->node, frameCtx);
+        VSFrame *dst = vspl_resample_new_frame(d, frame, d->width, d->height, core, vsapi);
+
+        vspl_resample_frame(d, frame, &dst, 1, core, vsapi);
 
         vsapi->freeFrame(frame);
         return dst;
@@ -394,80 +445,86 @@ static const VSFrame *VS_CC VSPlaceboResampleGetFrame(int n, int activationReaso
     return 0;
 }
 
-static void VS_CC VSPlaceboResampleFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    ResampleData *d = (ResampleData *) instanceData;
+static void vspl_resample_free_data(ResampleData *d, const VSAPI *vsapi) {
     vsapi->freeNode(d->node);
-    pl_shader_obj_destroy(&d->lut);
+    vspl_pool_destroy(&d->pool);
     free((void *) d->sampleParams->filter.kernel);
     free(d->sampleParams);
     free(d->sigmoid_params);
-    VSPlaceboUninit(d->vf);
-    pthread_mutex_destroy(&d->lock);
+}
+
+static void VS_CC VSPlaceboResampleFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    ResampleData *d = (ResampleData *) instanceData;
+    vspl_resample_free_data(d, vsapi);
     free(d);
 }
 
-void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *useResampleData, VSCore *core, const VSAPI *vsapi) {
-    ResampleData d;
-    ResampleData *data;
+/**
+ * Parses everything but the output size, which is shared between Resample
+ * and ResampleMulti. On failure, sets an error on `out` and returns false.
+ */
+static bool vspl_resample_init(ResampleData *d, const char *name, const VSMap *in, VSMap *out, VSCore *core, const VSAPI *vsapi) {
     int err;
     enum pl_log_level log_level;
-
-    if (pthread_mutex_init(&d.lock, NULL) != 0)
-    {
-        vsapi->mapSetError(out, "placebo.Resample: mutex init failed\n");
-        return;
-    }
+    char msg[128];
 
     log_level = vsapi->mapGetInt(in, "log_level", 0, &err);
     if (err)
         log_level = PL_LOG_ERR;
 
-    d.node = vsapi->mapGetNode(in, "clip", 0, 0);
-    d.vi = vsapi->getVideoInfo(d.node);
-    VSVideoInfo vi_out = *d.vi;
+    d->node = vsapi->mapGetNode(in, "clip", 0, 0);
+    d->vi = vsapi->getVideoInfo(d->node);
 
-    if ((d.vi->format.bitsPerSample != 8 && d.vi->format.bitsPerSample != 16 && d.vi->format.bitsPerSample != 32)) {
-        vsapi->mapSetError(out, "placebo.Resample: Input bitdepth should be 8, 16 (Integer) or 32 (Float)!.");
-        vsapi->freeNode(d.node);
+    if ((d->vi->format.bitsPerSample != 8 && d->vi->format.bitsPerSample != 16 && d->vi->format.bitsPerSample != 32)) {
+        snprintf(msg, sizeof(msg), "placebo.%s: Input bitdepth should be 8, 16 (Integer) or 32 (Float)!.", name);
+        vsapi->mapSetError(out, msg);
+        vsapi->freeNode(d->node);
+        return false;
     }
 
-    d.vf = VSPlaceboInit(log_level);
-
-    d.width = vsapi->mapGetInt(in, "width", 0, &err);
+    int num_contexts = vsapi->mapGetIntSaturated(in, "num_contexts", 0, &err);
     if (err)
-        d.width = d.vi->width;
+        num_contexts = 1;
 
-    d.height = vsapi->mapGetInt(in, "height", 0, &err);
-    if (err)
-        d.height = d.vi->height;
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS) {
+        snprintf(msg, sizeof(msg), "placebo.%s: num_contexts must be between 1 and " VSPL_STR(VSPL_MAX_CONTEXTS) "!", name);
+        vsapi->mapSetError(out, msg);
+        vsapi->freeNode(d->node);
+        return false;
+    }
 
-    vi_out.width = d.width;
-    vi_out.height = d.height;
+    d->pool = vspl_pool_create(num_contexts, log_level);
+    if (!d->pool) {
+        snprintf(msg, sizeof(msg), "placebo.%s: Failed initializing GPU contexts!", name);
+        vsapi->mapSetError(out, msg);
+        vsapi->freeNode(d->node);
+        return false;
+    }
 
-    d.src_width = vsapi->mapGetFloat(in, "src_width", 0, &err);
+    d->src_width = vsapi->mapGetFloat(in, "src_width", 0, &err);
     if (err)
-        d.src_width = d.vi->width;
+        d->src_width = d->vi->width;
 
-    d.src_height = vsapi->mapGetFloat(in, "src_height", 0, &err);
+    d->src_height = vsapi->mapGetFloat(in, "src_height", 0, &err);
     if (err)
-        d.src_height = d.vi->height;
+        d->src_height = d->vi->height;
 
-    d.src_x = vsapi->mapGetFloat(in, "sx", 0, &err);
-    d.src_y = vsapi->mapGetFloat(in, "sy", 0, &err);
-    d.linear = vsapi->mapGetInt(in, "linearize", 0, &err);
+    d->src_x = vsapi->mapGetFloat(in, "sx", 0, &err);
+    d->src_y = vsapi->mapGetFloat(in, "sy", 0, &err);
+    d->linear = vsapi->mapGetInt(in, "linearize", 0, &err);
     // only enable by default for RGB because linearizing YCbCr directly is incorrect and Gray may be a YCbCr plane
-    if (err) d.linear = d.vi->format.colorFamily == cfRGB;
+    if (err) d->linear = d->vi->format.colorFamily == cfRGB;
     // allow linearizing Gray manually, though, if the user knows what he’s doing
-    d.linear = d.linear && (d.vi->format.colorFamily == cfRGB || d.vi->format.colorFamily == cfGray);
+    d->linear = d->linear && (d->vi->format.colorFamily == cfRGB || d->vi->format.colorFamily == cfGray);
 
-    d.min_luma = vsapi->mapGetFloat(in, "min_luma", 0, &err);
+    d->min_luma = vsapi->mapGetFloat(in, "min_luma", 0, &err);
     if (err) {
         // Default to infinite contrast to match zimg.
-        d.min_luma = PL_COLOR_HDR_BLACK;
+        d->min_luma = PL_COLOR_HDR_BLACK;
     }
 
-    d.trc = vsapi->mapGetInt(in, "trc", 0, &err);
-    if (err) d.trc = 1;
+    d->trc = vsapi->mapGetInt(in, "trc", 0, &err);
+    if (err) d->trc = 1;
 
     struct pl_sigmoid_params *sigmoidParams = malloc(sizeof(struct pl_sigmoid_params));
     *sigmoidParams = pl_sigmoid_default_params;
@@ -483,15 +540,19 @@ void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *useResampl
     // same reasoning as with linear
     bool sigm = vsapi->mapGetInt(in, "sigmoidize", 0, &err);
     if (err)
-        sigm = d.vi->format.colorFamily == cfRGB;
+        sigm = d->vi->format.colorFamily == cfRGB;
 
-    sigm = sigm && (d.vi->format.colorFamily == cfRGB || d.vi->format.colorFamily == cfGray);
-    d.sigmoid_params = sigm ? sigmoidParams : NULL;
+    sigm = sigm && (d->vi->format.colorFamily == cfRGB || d->vi->format.colorFamily == cfGray);
+    if (sigm) {
+        d->sigmoid_params = sigmoidParams;
+    } else {
+        d->sigmoid_params = NULL;
+        free(sigmoidParams);
+    }
 
 
     struct pl_sample_filter_params *sampleFilterParams = calloc(1, sizeof(struct pl_sample_filter_params));;
 
-    d.lut = NULL;
     sampleFilterParams->no_widening = false;
     sampleFilterParams->no_compute = false;
     sampleFilterParams->antiring = vsapi->mapGetFloat(in, "antiring", 0, &err);
@@ -532,7 +593,31 @@ void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *useResampl
         f->params[1] = vsapi->mapGetFloat(in, "param2", 0, &err);
 
     sampleFilterParams->filter.kernel = f;
-    d.sampleParams = sampleFilterParams;
+    d->sampleParams = sampleFilterParams;
+
+    return true;
+}
+
+void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *useResampleData, VSCore *core, const VSAPI *vsapi) {
+    ResampleData d;
+    ResampleData *data;
+    int err;
+
+    if (!vspl_resample_init(&d, "Resample", in, out, core, vsapi))
+        return;
+
+    VSVideoInfo vi_out = *d.vi;
+
+    d.width = vsapi->mapGetInt(in, "width", 0, &err);
+    if (err)
+        d.width = d.vi->width;
+
+    d.height = vsapi->mapGetInt(in, "height", 0, &err);
+    if (err)
+        d.height = d.vi->height;
+
+    vi_out.width = d.width;
+    vi_out.height = d.height;
 
     data = malloc(sizeof(d));
     *data = d;
@@ -552,3 +637,265 @@ void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *useResampl
         core
     );
 }
+
+//
+// ResampleMulti
+//
+// One source, several output sizes. Whichever output first asks for frame n
+// uploads and prepasses it once and renders every size; the other outputs
+// then pick their frame up from a small cache instead of uploading again.
+// When a frame is asked for again after its output already took it, or an
+// entry was evicted before a lagging output got to it, only the requested
+// size is rendered.
+//
+
+#define VSPL_RESAMPLE_MAX_OUTPUTS 8
+#define VSPL_RESAMPLE_CACHE_SIZE 8
+
+typedef struct {
+    int n;
+    bool used;
+    bool pending; // being rendered, wait on ResampleMultiData.cond
+    uint64_t seq;
+    int remaining;
+    VSFrame *frames[VSPL_RESAMPLE_MAX_OUTPUTS];
+} ResampleMultiEntry;
+
+typedef struct {
+    ResampleData d;
+    int num_outputs;
+    int widths[VSPL_RESAMPLE_MAX_OUTPUTS];
+    int heights[VSPL_RESAMPLE_MAX_OUTPUTS];
+
+    // Shared by all output nodes, the last one to be freed cleans up
+    atomic_int refs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ResampleMultiEntry cache[VSPL_RESAMPLE_CACHE_SIZE];
+    uint64_t seq;
+} ResampleMultiData;
+
+typedef struct {
+    ResampleMultiData *m;
+    int index;
+} ResampleMultiOutput;
+
+static void vspl_resample_multi_clear(ResampleMultiEntry *e, const VSAPI *vsapi) {
+    for (int k = 0; k < VSPL_RESAMPLE_MAX_OUTPUTS; k++) {
+        vsapi->freeFrame(e->frames[k]);
+        e->frames[k] = NULL;
+    }
+
+    e->used = false;
+}
+
+/**
+ * Returns a free cache slot, or evicts the least recently rendered entry.
+ * Entries are normally cleared once the last output has taken its frame, so
+ * eviction only hits entries of outputs that are never requested or lag far
+ * behind; those then render their own size on demand. Returns NULL only if
+ * every slot is still being rendered. Called with the lock held.
+ */
+static ResampleMultiEntry *vspl_resample_multi_claim(ResampleMultiData *m, const VSAPI *vsapi) {
+    ResampleMultiEntry *victim = NULL;
+    for (int i = 0; i < VSPL_RESAMPLE_CACHE_SIZE; i++) {
+        ResampleMultiEntry *e = &m->cache[i];
+        if (!e->used)
+            return e;
+        if (!e->pending && (!victim || e->seq < victim->seq))
+            victim = e;
+    }
+
+    if (victim)
+        vspl_resample_multi_clear(victim, vsapi);
+
+    return victim;
+}
+
+static VSFrame *vspl_resample_multi_get(ResampleMultiData *m, int n, int index, const VSFrame *frame, VSCore *core, const VSAPI *vsapi) {
+    ResampleMultiEntry *e;
+    VSFrame *dst = NULL;
+
+    pthread_mutex_lock(&m->lock);
+    for (;;) {
+        e = NULL;
+        for (int i = 0; i < VSPL_RESAMPLE_CACHE_SIZE; i++) {
+            if (m->cache[i].used && m->cache[i].n == n) {
+                e = &m->cache[i];
+                break;
+            }
+        }
+
+        if (!e || !e->pending)
+            break;
+
+        pthread_cond_wait(&m->cond, &m->lock);
+    }
+
+    if (e) {
+        dst = e->frames[index];
+        e->frames[index] = NULL;
+        if (dst && --e->remaining == 0)
+            vspl_resample_multi_clear(e, vsapi);
+
+        if (dst) {
+            pthread_mutex_unlock(&m->lock);
+            return dst;
+        }
+
+        // Already handed out, e.g. the frame was requested again after
+        // VapourSynth dropped it from its own cache. Render without caching.
+        e = NULL;
+    } else {
+        // May be NULL if every slot is being rendered, then render uncached
+        e = vspl_resample_multi_claim(m, vsapi);
+        if (e) {
+            e->used = true;
+            e->pending = true;
+            e->n = n;
+            e->seq = m->seq++;
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    if (!e) {
+        // Nothing to share the other sizes through, only render this one
+        dst = vspl_resample_new_frame(&m->d, frame, m->widths[index], m->heights[index], core, vsapi);
+        vspl_resample_frame(&m->d, frame, &dst, 1, core, vsapi);
+        return dst;
+    }
+
+    VSFrame *frames[VSPL_RESAMPLE_MAX_OUTPUTS];
+    for (int k = 0; k < m->num_outputs; k++)
+        frames[k] = vspl_resample_new_frame(&m->d, frame, m->widths[k], m->heights[k], core, vsapi);
+
+    vspl_resample_frame(&m->d, frame, frames, m->num_outputs, core, vsapi);
+
+    dst = frames[index];
+    frames[index] = NULL;
+
+    pthread_mutex_lock(&m->lock);
+    e->remaining = m->num_outputs - 1;
+    for (int k = 0; k < m->num_outputs; k++)
+        e->frames[k] = frames[k];
+
+    e->pending = false;
+    if (!e->remaining)
+        vspl_resample_multi_clear(e, vsapi);
+
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+
+    return dst;
+}
+
+static const VSFrame *VS_CC VSPlaceboResampleMultiGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ResampleMultiOutput *o = (ResampleMultiOutput *) instanceData;
+    ResampleMultiData *m = o->m;
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, m->d.node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *frame = vsapi->getFrameFilter(n, m->d.node, frameCtx);
+        VSFrame *dst = vspl_resample_multi_get(m, n, o->index, frame, core, vsapi);
+
+        vsapi->freeFrame(frame);
+        return dst;
+    }
+
+    return 0;
+}
+
+static void vspl_resample_multi_unref(ResampleMultiData *m, const VSAPI *vsapi) {
+    if (atomic_fetch_sub(&m->refs, 1) > 1)
+        return;
+
+    for (int i = 0; i < VSPL_RESAMPLE_CACHE_SIZE; i++)
+        vspl_resample_multi_clear(&m->cache[i], vsapi);
+
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+    vspl_resample_free_data(&m->d, vsapi);
+    free(m);
+}
+
+static void VS_CC VSPlaceboResampleMultiFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    ResampleMultiOutput *o = (ResampleMultiOutput *) instanceData;
+    vspl_resample_multi_unref(o->m, vsapi);
+    free(o);
+}
+
+void VS_CC VSPlaceboResampleMultiCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    int num = vsapi->mapNumElements(in, "widths");
+    if (num < 1 || num > VSPL_RESAMPLE_MAX_OUTPUTS) {
+        vsapi->mapSetError(out, "placebo.ResampleMulti: widths must have between 1 and 8 entries!");
+        return;
+    }
+
+    if (vsapi->mapNumElements(in, "heights") != num) {
+        vsapi->mapSetError(out, "placebo.ResampleMulti: widths and heights must have the same number of entries!");
+        return;
+    }
+
+    ResampleMultiData *m = calloc(1, sizeof(*m));
+    if (!vspl_resample_init(&m->d, "ResampleMulti", in, out, core, vsapi)) {
+        free(m);
+        return;
+    }
+
+    m->num_outputs = num;
+    for (int k = 0; k < num; k++) {
+        m->widths[k] = vsapi->mapGetIntSaturated(in, "widths", k, NULL);
+        m->heights[k] = vsapi->mapGetIntSaturated(in, "heights", k, NULL);
+
+        if (m->widths[k] <= 0 || m->heights[k] <= 0) {
+            vsapi->mapSetError(out, "placebo.ResampleMulti: widths and heights must be positive!");
+            vspl_resample_free_data(&m->d, vsapi);
+            free(m);
+            return;
+        }
+    }
+
+    m->d.width = m->widths[0];
+    m->d.height = m->heights[0];
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    atomic_init(&m->refs, num);
+
+    VSFilterDependency deps[] = {{m->d.node, rpStrictSpatial}};
+
+    for (int k = 0; k < num; k++) {
+        VSVideoInfo vi_out = *m->d.vi;
+        vi_out.width = m->widths[k];
+        vi_out.height = m->heights[k];
+
+        ResampleMultiOutput *o = malloc(sizeof(*o));
+        o->m = m;
+        o->index = k;
+
+        VSNode *node = vsapi->createVideoFilter2(
+            "ResampleMulti",
+            &vi_out,
+            VSPlaceboResampleMultiGetFrame,
+            VSPlaceboResampleMultiFree,
+            fmParallel,
+            deps,
+            1,
+            o,
+            core
+        );
+
+        // Output k's reference isn't owned by a node either
+        if (!node) {
+            vsapi->mapSetError(out, "placebo.ResampleMulti: Failed creating output node!");
+            free(o);
+            for (int j = k; j < num; j++)
+                vspl_resample_multi_unref(m, vsapi);
+            return;
+        }
+
+        vsapi->mapConsumeNode(out, "clip", node, maAppend);
+    }
+}
@@ -4,5 +4,6 @@
 #include <VapourSynth4.h>
 
 void VS_CC VSPlaceboResampleCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
+void VS_CC VSPlaceboResampleMultiCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
 
 #endif //VS_PLACEBO_RESAMPLE_H
@@ -6,7 +6,6 @@
 
 #include <VapourSynth4.h>
 
-#include "libp2p/p2p_api.h"
 #include <libplacebo/shaders/custom.h>
 #include <libplacebo/colorspace.h>
 
@@ -19,8 +18,7 @@ typedef  struct {
     int height;
     const VSVideoInfo *vi;
     VSVideoInfo vi_out;
-    struct priv *vf;
-    const struct pl_hook *shader;
+    struct vspl_pool *pool;
     enum pl_color_system matrix;
     enum pl_color_levels range;
     enum pl_chroma_location chromaLocation;
@@ -28,7 +26,6 @@ typedef  struct {
     struct pl_sigmoid_params *sigmoid_params;
     enum pl_color_transfer trc;
     bool linear;
-    pthread_mutex_t lock;
 } ShaderData;
 
 
@@ -36,6 +33,18 @@ bool vspl_shader_do_plane(struct priv *p, void *data, int n, struct pl_plane *pl
 {
     ShaderData *d = (ShaderData*) data;
 
+    // Integer samples are LSB-aligned in their container, e.g. 10 bits in 16
+    const VSVideoFormat *src_fmt = &d->vi->format;
+    const bool src_float = src_fmt->sampleType == stFloat;
+    const struct pl_color_repr src_repr = {
+        .bits = {
+            .sample_depth = src_fmt->bytesPerSample * 8,
+            .color_depth = src_float ? src_fmt->bytesPerSample * 8 : src_fmt->bitsPerSample,
+            .bit_shift = 0
+        },
+        .sys = d->matrix,
+        .levels = d->range
+    };
     const struct pl_color_repr crpr = {
         .bits = {
             .sample_depth = 16,
@@ -51,7 +60,7 @@ bool vspl_shader_do_plane(struct priv *p, void *data, int n, struct pl_plane *pl
 
     struct pl_frame img = {
         .num_planes = 3,
-        .repr = crpr,
+        .repr = src_repr,
         .planes = {planes[0], planes[1], planes[2]},
         .color = csp,
     };
@@ -60,19 +69,27 @@ bool vspl_shader_do_plane(struct priv *p, void *data, int n, struct pl_plane *pl
         pl_frame_set_chroma_location(&img, d->chromaLocation);
     }
 
+    // Planar target, chroma planes may be subsampled
     struct pl_frame out = {
-        .num_planes = 1,
-        .planes = {{
-            .texture = p->tex_out[0],
-            .components = p->tex_out[0]->params.format->num_components,
-            .component_mapping = {0, 1, 2, 3},
-        }},
+        .num_planes = 3,
         .repr = crpr,
         .color = csp,
     };
 
+    for (int i = 0; i < 3; i++) {
+        out.planes[i] = (struct pl_plane) {
+            .texture = p->tex_out[i],
+            .components = 1,
+            .component_mapping = {i},
+        };
+    }
+
+    if (d->vi_out.format.subSamplingW || d->vi_out.format.subSamplingH) {
+        pl_frame_set_chroma_location(&out, d->chromaLocation);
+    }
+
     struct pl_render_params renderParams = {
-        .hooks = &d->shader,
+        .hooks = &p->hook,
         .num_hooks = 1,
         .sigmoid_params = d->sigmoid_params,
         .disable_linear_scaling = !d->linear,
@@ -99,32 +116,32 @@ bool vspl_shader_reconfig(void *priv, struct pl_plane_data *data, VSCore *core,
 
     bool ok = true;
     for (int i = 0; i < 3; ++i) {
-        ok &= pl_tex_recreate(p->gpu, &p->tex_in[i], pl_tex_params(
+        ok &= vspl_tex_recreate(p, &p->tex_in[i], pl_tex_params(
             .w = data[i].width,
             .h = data[i].height,
             .format = fmt[i],
             .sampleable = true,
             .host_writable = true,
+            .blit_src = fmt[i]->caps & PL_FMT_CAP_BLITTABLE,
         ));
     }
 
-    const struct pl_plane_data plane_data = {
-        .type = PL_FMT_UNORM,
-        .component_map = {0, 1, 2, 0},
-        .component_pad = {0, 0, 0, 0},
-        .component_size = {16, 16, 16, 0},
-        .pixel_stride = 6
-    };
-
-    pl_fmt out = pl_plane_find_fmt(p->gpu, NULL, &plane_data);
+    pl_fmt out = pl_find_fmt(p->gpu, PL_FMT_UNORM, 1, 16, 16, PL_FMT_CAP_RENDERABLE | PL_FMT_CAP_HOST_READABLE);
+    if (!out) {
+        vsapi->logMessage(mtCritical, "Failed configuring filter: no good output texture format!\n", core);
+        return false;
+    }
 
-    ok &= pl_tex_recreate(p->gpu, &p->tex_out[0], pl_tex_params(
-        .w = d->width,
-        .h = d->height,
-        .format = out,
-        .renderable = true,
-        .host_readable = true,
-    ));
+    const VSVideoFormat *dst_fmt = &d->vi_out.format;
+    for (int i = 0; i < 3; ++i) {
+        ok &= vspl_tex_recreate(p, &p->tex_out[i], pl_tex_params(
+            .w = i ? d->width >> dst_fmt->subSamplingW : d->width,
+            .h = i ? d->height >> dst_fmt->subSamplingH : d->height,
+            .format = out,
+            .renderable = true,
+            .host_readable = true,
+        ));
+    }
 
     if (!ok) {
         vsapi->logMessage(mtCritical, "Failed creating GPU textures!\n", core);
@@ -134,7 +151,7 @@ bool vspl_shader_reconfig(void *priv, struct pl_plane_data *data, VSCore *core,
     return true;
 }
 
-bool vspl_shader_filter(void *priv, void *dst, struct pl_plane_data *src,  ShaderData *d, int n, VSCore *core, const VSAPI *vsapi)
+bool vspl_shader_filter(void *priv, VSFrame *dst, struct pl_plane_data *src,  ShaderData *d, int n, VSCore *core, const VSAPI *vsapi)
 {
     struct priv *p = priv;
     // Upload planes
@@ -142,6 +159,7 @@ bool vspl_shader_filter(void *priv, void *dst, struct pl_plane_data *src,  Shade
     bool ok = true;
 
     for (int i = 0; i < 3; ++i) {
+        vspl_stage_plane(p, i, &src[i]);
         ok &= pl_upload_plane(p->gpu, &planes[i], &p->tex_in[i], &src[i]);
     }
 
@@ -156,11 +174,12 @@ bool vspl_shader_filter(void *priv, void *dst, struct pl_plane_data *src,  Shade
         return false;
     }
 
-    // Download planes
-    ok = pl_tex_download(p->gpu, pl_tex_transfer_params(
-        .tex = p->tex_out[0],
-        .ptr = dst,
-    ));
+    // Download planes straight into the destination frame
+    for (int i = 0; i < 3; ++i)
+        ok &= vspl_download_start(p, i, p->tex_out[i], vsapi->getWritePtr(dst, i), vsapi->getStride(dst, i));
+
+    for (int i = 0; i < 3; ++i)
+        ok &= vspl_download_finish(p, i);
 
     if (!ok) {
         vsapi->logMessage(mtCritical, "Failed downloading data from the GPU!\n", core);
@@ -189,52 +208,32 @@ static const VSFrame *VS_CC VSPlaceboShaderGetFrame(int n, int activationReason,
                 d->range = r ? PL_COLOR_LEVELS_TV : PL_COLOR_LEVELS_PC;
         }
 
-        const VSVideoFormat dstfmt = d->vi_out.format;
-        vsapi->queryVideoFormat(&dstfmt, dstfmt.colorFamily, dstfmt.sampleType, dstfmt.bitsPerSample, 0, 0, core);
-
-        VSFrame *dst = vsapi->newVideoFrame(&dstfmt, d->width, d->height, frame, core);
+        VSFrame *dst = vsapi->newVideoFrame(&d->vi_out.format, d->width, d->height, frame, core);
 
+        const VSVideoFormat *src_fmt = &d->vi->format;
         struct pl_plane_data planes[4] = {0};
         for (int j = 0; j < 3; ++j) {
             planes[j] = (struct pl_plane_data) {
-                .type = PL_FMT_UNORM,
+                .type = src_fmt->sampleType == stFloat ? PL_FMT_FLOAT : PL_FMT_UNORM,
                 .width = vsapi->getFrameWidth(frame, j),
                 .height = vsapi->getFrameHeight(frame, j),
-                .pixel_stride = 2,
+                .pixel_stride = src_fmt->bytesPerSample,
                 .row_stride =  vsapi->getStride(frame, j),
                 .pixels = vsapi->getReadPtr((VSFrame *) frame, j),
             };
 
-            planes[j].component_size[0] = 16;
+            planes[j].component_size[0] = src_fmt->bytesPerSample * 8;
             planes[j].component_pad[0] = 0;
             planes[j].component_map[0] = j;
         }
 
-        void *packed_dst = malloc(d->width * d->height * 2 * 3);
-
-        pthread_mutex_lock(&d->lock);
-
-        if (vspl_shader_reconfig(d->vf, planes, core, vsapi, d)) {
-            vspl_shader_filter(d->vf, packed_dst, planes, d, n, core, vsapi);
-        }
-
-        pthread_mutex_unlock(&d->lock);
-
-        struct p2p_buffer_param pack_params = {
-            .width = d->width,
-            .height = d->height,
-            .packing = p2p_bgr48_le,
-            .src[0] = packed_dst,
-            .src_stride[0] = d->width * 2 * 3
-        };
+        struct priv *p = vspl_pool_acquire(d->pool);
 
-        for (int k = 0; k < 3; ++k) {
-            pack_params.dst[k] = vsapi->getWritePtr(dst, k);
-            pack_params.dst_stride[k] = vsapi->getStride(dst, k);
+        if (vspl_shader_reconfig(p, planes, core, vsapi, d)) {
+            vspl_shader_filter(p, dst, planes, d, n, core, vsapi);
         }
 
-        p2p_unpack_frame(&pack_params, 0);
-        free(packed_dst);
+        vspl_pool_release(d->pool, p);
 
         vsapi->freeFrame(frame);
         return dst;
@@ -243,15 +242,20 @@ static const VSFrame *VS_CC VSPlaceboShaderGetFrame(int n, int activationReason,
     return 0;
 }
 
+static void vspl_shader_destroy_hooks(struct vspl_pool *pool)
+{
+    for (int i = 0; i < pool->num_ctx; i++)
+        pl_mpv_user_shader_destroy(&pool->ctx[i]->hook);
+}
+
 static void VS_CC VSPlaceboShaderFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ShaderData *d = (ShaderData *)instanceData;
     vsapi->freeNode(d->node);
-    pl_mpv_user_shader_destroy(&d->shader);
+    vspl_shader_destroy_hooks(d->pool);
     free((void *) d->sampleParams->filter.kernel);
     free(d->sampleParams);
     free(d->sigmoid_params);
-    VSPlaceboUninit(d->vf);
-    pthread_mutex_destroy(&d->lock);
+    vspl_pool_destroy(&d->pool);
     free(d);
 }
 
@@ -261,11 +265,6 @@ void VS_CC VSPlaceboShaderCreate(const VSMap *in, VSMap *out, void *userData, VS
     int err;
     enum pl_log_level log_level;
 
-    if (pthread_mutex_init(&d.lock, NULL) != 0) {
-        vsapi->mapSetError(out, "placebo.Shader: mutex init failed\n");
-        return;
-    }
-
     log_level = vsapi->mapGetInt(in, "log_level", 0, &err);
     if (err)
         log_level = PL_LOG_ERR;
@@ -307,22 +306,65 @@ void VS_CC VSPlaceboShaderCreate(const VSMap *in, VSMap *out, void *userData, VS
     d.vi = vsapi->getVideoInfo(d.node);
 
     d.vi_out = *d.vi;
-    vsapi->getVideoFormatByID(&d.vi_out.format, pfYUV444P16, core);
 
-    d.vf = VSPlaceboInit(log_level);
-    d.shader = pl_mpv_user_shader_parse(d.vf->gpu, shader, strlen(shader));
+    int out_format = vsapi->mapGetIntSaturated(in, "format", 0, &err);
+    if (err)
+        out_format = pfYUV444P16;
+
+    if (!vsapi->getVideoFormatByID(&d.vi_out.format, out_format, core)
+        || d.vi_out.format.colorFamily != cfYUV
+        || d.vi_out.format.sampleType != stInteger
+        || d.vi_out.format.bitsPerSample != 16
+        || d.vi_out.format.subSamplingW > 1
+        || d.vi_out.format.subSamplingH > d.vi_out.format.subSamplingW) {
+        free(shader);
+        vsapi->mapSetError(out, "placebo.Shader: Output format must be YUV444P16, YUV422P16 or YUV420P16!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    int num_contexts = vsapi->mapGetIntSaturated(in, "num_contexts", 0, &err);
+    if (err)
+        num_contexts = 1;
+
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS) {
+        free(shader);
+        vsapi->mapSetError(out, "placebo.Shader: num_contexts must be between 1 and " VSPL_STR(VSPL_MAX_CONTEXTS) "!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.pool = vspl_pool_create(num_contexts, log_level);
+    if (!d.pool) {
+        free(shader);
+        vsapi->mapSetError(out, "placebo.Shader: Failed initializing GPU contexts!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    // User shader hooks keep internal state, so every context needs its own
+    bool parsed = true;
+    for (int i = 0; i < d.pool->num_ctx; i++) {
+        struct priv *p = d.pool->ctx[i];
+        p->hook = pl_mpv_user_shader_parse(p->gpu, shader, strlen(shader));
+        parsed &= p->hook != NULL;
+    }
     free(shader);
 
-    if (!d.shader) {
-        VSPlaceboUninit(d.vf);
-        pl_mpv_user_shader_destroy(&d.shader);
+    if (!parsed) {
+        vspl_shader_destroy_hooks(d.pool);
+        vspl_pool_destroy(&d.pool);
         vsapi->mapSetError(out, "placebo.Shader: Failed parsing shader!");
         vsapi->freeNode(d.node);
         return;
     }
 
-    if (d.vi->format.colorFamily != cfYUV || d.vi->format.bitsPerSample != 16) {
-        vsapi->mapSetError(out, "placebo.Shader: Input should be YUVxxxP16!");
+    const VSVideoFormat *in_fmt = &d.vi->format;
+    if (in_fmt->colorFamily != cfYUV
+        || (in_fmt->sampleType == stInteger ? in_fmt->bitsPerSample > 16 : in_fmt->bitsPerSample < 16)) {
+        vsapi->mapSetError(out, "placebo.Shader: Input must be YUV, 8-16 bit integer or 16/32 bit float!");
+        vspl_shader_destroy_hooks(d.pool);
+        vspl_pool_destroy(&d.pool);
         vsapi->freeNode(d.node);
         return;
     }
@@ -340,6 +382,14 @@ void VS_CC VSPlaceboShaderCreate(const VSMap *in, VSMap *out, void *userData, VS
     if (err)
         d.height = d.vi->height;
 
+    if (d.width % (1 << d.vi_out.format.subSamplingW) || d.height % (1 << d.vi_out.format.subSamplingH)) {
+        vsapi->mapSetError(out, "placebo.Shader: Output dimensions must be divisible by the output format's subsampling!");
+        vspl_shader_destroy_hooks(d.pool);
+        vspl_pool_destroy(&d.pool);
+        vsapi->freeNode(d.node);
+        return;
+    }
+
     d.vi_out.width = d.width;
     d.vi_out.height = d.height;
 
@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,9 +8,8 @@
 
 #include <VapourSynth4.h>
 
-#include "libp2p/p2p_api.h"
-
 #include "vs-placebo.h"
+#include "analyze.h"
 
 #ifdef HAVE_DOVI
 #include <libdovi/rpu_parser.h>
@@ -27,58 +27,154 @@ typedef struct {
     VSNode *node;
     const VSVideoInfo *vi;
     VSVideoInfo vi_out;
-    struct priv *vf;
+    struct vspl_pool *pool;
+
+    struct vspl_dovi_cache *dovi_cache;
 
     struct pl_render_params *renderParams;
 
     enum supported_colorspace src_csp;
     enum supported_colorspace dst_csp;
 
-    struct pl_color_space *src_pl_csp;
-    struct pl_color_space *dst_pl_csp;
-
-    pthread_mutex_t lock;
-
-    float original_src_max;
-    float original_src_min;
+    // Defaults from the arguments, frames work on copies
+    const struct pl_color_space *src_pl_csp;
+    const struct pl_color_space *dst_pl_csp;
 
     bool is_subsampled;
-    enum pl_chroma_location chromaLocation;
 
     bool use_dovi;
+    atomic_bool dovi_warned; // about RPUs deferring further back than we look
+
+    // Per-frame scene peak/average from placebo.AnalyzeHDR, if given
+    struct vspl_hdr_scenes scenes;
+
+    // Bucket size for dynamic metadata, in 12-bit PQ code values, 0 if disabled
+    int quantize;
 } TMData;
 
-bool vspl_tonemap_do_planes(TMData *tm_data, struct pl_plane *planes,
-                 const struct pl_color_repr src_repr, const struct pl_color_repr dst_repr)
+/** Colour state of a single frame, built from its props. */
+struct vspl_tonemap_frame {
+    struct pl_color_space src_csp;
+    struct pl_color_space dst_csp;
+    enum pl_chroma_location chroma_loc;
+};
+
+/** Chroma location for subsampled output, defaulting to left if the source has none. */
+static enum pl_chroma_location vspl_tonemap_out_chroma_loc(enum pl_chroma_location loc)
 {
-    struct priv *p = tm_data->vf;
+    return loc != PL_CHROMA_UNKNOWN ? loc : PL_CHROMA_LEFT;
+}
 
+static float vspl_quantize_pq(float pq, int step)
+{
+    return roundf(pq * 4095.0f / step) * step / 4095.0f;
+}
+
+static float vspl_quantize_nits(float nits, int step)
+{
+    if (nits <= 0)
+        return nits;
+
+    const float pq = vspl_quantize_pq(pl_hdr_rescale(PL_HDR_NITS, PL_HDR_PQ, nits), step);
+    return pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, pq);
+}
+
+/**
+ * Snaps the brightness metadata to PQ buckets. Frames in the same bucket get
+ * identical tone mapping parameters, so the renderer can keep its LUTs
+ * instead of regenerating them for every small change.
+ */
+static void vspl_tonemap_quantize(struct pl_hdr_metadata *hdr, int step)
+{
+    hdr->max_luma = vspl_quantize_nits(hdr->max_luma, step);
+    hdr->max_cll = vspl_quantize_nits(hdr->max_cll, step);
+    hdr->max_fall = vspl_quantize_nits(hdr->max_fall, step);
+
+#if PL_API_VER >= 246
+    for (int i = 0; i < 3; i++)
+        hdr->scene_max[i] = vspl_quantize_nits(hdr->scene_max[i], step);
+    hdr->scene_avg = vspl_quantize_nits(hdr->scene_avg, step);
+#endif
+
+#if PL_API_VER >= 257
+    hdr->max_pq_y = vspl_quantize_pq(hdr->max_pq_y, step);
+    hdr->avg_pq_y = vspl_quantize_pq(hdr->avg_pq_y, step);
+#endif
+}
+
+/**
+ * Picks the renderer that last tone mapped between the same colour spaces,
+ * so its LUTs can be reused as they are. On a miss the least recently used
+ * of the first `num_slots` renderers is repurposed, creating it if needed.
+ * Returns NULL if that fails.
+ */
+static pl_renderer vspl_tonemap_renderer(struct priv *p, const struct vspl_tonemap_frame *f, int num_slots)
+{
+    struct vspl_tm_slot *lru = &p->tm_slots[0];
+    for (int i = 0; i < num_slots; i++) {
+        struct vspl_tm_slot *s = &p->tm_slots[i];
+        if (s->last_used && pl_color_space_equal(&f->src_csp, &s->src) && pl_color_space_equal(&f->dst_csp, &s->dst)) {
+            s->last_used = ++p->tm_clock;
+            return s->rr;
+        }
+
+        if (s->last_used < lru->last_used)
+            lru = s;
+    }
+
+    if (!lru->rr)
+        lru->rr = lru == &p->tm_slots[0] ? p->rr : pl_renderer_create(p->log, p->gpu);
+    if (!lru->rr)
+        return NULL;
+
+    // Counts repurposed slots, filling an unused one isn't an eviction
+    if (lru->last_used)
+        atomic_fetch_add(&vspl_stats.tonemap_slot_evictions, 1);
+
+    lru->src = f->src_csp;
+    lru->dst = f->dst_csp;
+    lru->last_used = ++p->tm_clock;
+    return lru->rr;
+}
+
+bool vspl_tonemap_do_planes(struct priv *p, pl_renderer rr, TMData *tm_data, const struct vspl_tonemap_frame *f,
+                 struct pl_plane *planes, const struct pl_color_repr src_repr, const struct pl_color_repr dst_repr)
+{
     struct pl_frame img = {
         .num_planes = 3,
         .planes     = {planes[0], planes[1], planes[2]},
         .repr       = src_repr,
-        .color      = *tm_data->src_pl_csp,
+        .color      = f->src_csp,
     };
 
     if (tm_data->is_subsampled) {
-        pl_frame_set_chroma_location(&img, tm_data->chromaLocation);
+        pl_frame_set_chroma_location(&img, f->chroma_loc);
     }
 
+    // Planar target, one texture per output plane
     struct pl_frame out = {
-        .num_planes = 1,
-        .planes = {{
-            .texture = p->tex_out[0],
-            .components = p->tex_out[0]->params.format->num_components,
-            .component_mapping = {0, 1, 2, 3},
-        }},
+        .num_planes = 3,
         .repr = dst_repr,
-        .color = *tm_data->dst_pl_csp,
+        .color = f->dst_csp,
     };
 
-    return pl_render_image(p->rr, &img, &out, tm_data->renderParams);
+    for (int i = 0; i < 3; i++) {
+        out.planes[i] = (struct pl_plane) {
+            .texture = p->tex_out[i],
+            .components = 1,
+            .component_mapping = {i},
+        };
+    }
+
+    // Chroma is downsampled on the GPU, sited like the source's
+    if (tm_data->vi_out.format.subSamplingW || tm_data->vi_out.format.subSamplingH) {
+        pl_frame_set_chroma_location(&out, vspl_tonemap_out_chroma_loc(f->chroma_loc));
+    }
+
+    return pl_render_image(rr, &img, &out, tm_data->renderParams);
 }
 
-bool vspl_tonemap_reconfig(void *priv, struct pl_plane_data *data, VSCore *core, const VSAPI *vsapi)
+bool vspl_tonemap_reconfig(void *priv, struct pl_plane_data *data, const VSVideoFormat *dst_fmt, VSCore *core, const VSAPI *vsapi)
 {
     struct priv *p = priv;
 
@@ -90,37 +186,35 @@ bool vspl_tonemap_reconfig(void *priv, struct pl_plane_data *data, VSCore *core,
 
     bool ok = true;
     for (int i = 0; i < 3; ++i) {
-        ok &= pl_tex_recreate(p->gpu, &p->tex_in[i], pl_tex_params(
-            .w = data->width,
-            .h = data->height,
+        ok &= vspl_tex_recreate(p, &p->tex_in[i], pl_tex_params(
+            .w = data[i].width,
+            .h = data[i].height,
             .format = fmt,
             .sampleable = true,
             .host_writable = true,
+            .blit_src = fmt->caps & PL_FMT_CAP_BLITTABLE,
         ));
     }
 
-    const struct pl_plane_data plane_data = {
-        .type = PL_FMT_UNORM,
-        .component_map = {0, 1, 2, 0},
-        .component_pad = {0, 0, 0, 0},
-        .component_size = {16, 16, 16, 0},
-        .width = 10,
-        .height = 10,
-        .row_stride = 60,
-        .pixel_stride = 6
-    };
-
-    pl_fmt out = pl_plane_find_fmt(p->gpu, NULL, &plane_data);
+    const int out_bits = dst_fmt->bytesPerSample * 8;
+    pl_fmt out = pl_find_fmt(p->gpu, dst_fmt->sampleType == stFloat ? PL_FMT_FLOAT : PL_FMT_UNORM, 1, out_bits, out_bits,
+                             PL_FMT_CAP_RENDERABLE | PL_FMT_CAP_HOST_READABLE);
+    if (!out) {
+        vsapi->logMessage(mtCritical, "Failed configuring filter: no good output texture format!\n", core);
+        return false;
+    }
 
-    ok &= pl_tex_recreate(p->gpu, &p->tex_out[0], pl_tex_params(
-        .w = data->width,
-        .h = data->height,
-        .format = out,
-        .renderable = true,
-        .host_readable = true,
-        .storable = true,
-        .blit_dst = true,
-    ));
+    for (int i = 0; i < 3; ++i) {
+        ok &= vspl_tex_recreate(p, &p->tex_out[i], pl_tex_params(
+            .w = i ? data->width >> dst_fmt->subSamplingW : data->width,
+            .h = i ? data->height >> dst_fmt->subSamplingH : data->height,
+            .format = out,
+            .renderable = true,
+            .host_readable = true,
+            .storable = out->caps & PL_FMT_CAP_STORABLE,
+            .blit_dst = out->caps & PL_FMT_CAP_BLITTABLE,
+        ));
+    }
 
     if (!ok) {
         vsapi->logMessage(mtCritical, "Failed creating GPU textures!\n", core);
@@ -130,16 +224,16 @@ bool vspl_tonemap_reconfig(void *priv, struct pl_plane_data *data, VSCore *core,
     return true;
 }
 
-bool vspl_tonemap_filter(TMData *tm_data, void *dst, struct pl_plane_data *src, VSCore *core, const VSAPI *vsapi,
+bool vspl_tonemap_filter(struct priv *p, pl_renderer rr, TMData *tm_data, const struct vspl_tonemap_frame *f, VSFrame *dst,
+               struct pl_plane_data *src, VSCore *core, const VSAPI *vsapi,
                const struct pl_color_repr src_repr, const struct pl_color_repr dst_repr)
 {
-    struct priv *p = tm_data->vf;
-
     // Upload planes
     struct pl_plane planes[4] = {0};
 
     bool ok = true;
     for (int i = 0; i < 3; ++i) {
+        vspl_stage_plane(p, i, &src[i]);
         ok &= pl_upload_plane(p->gpu, &planes[i], &p->tex_in[i], &src[i]);
     }
 
@@ -149,16 +243,17 @@ bool vspl_tonemap_filter(TMData *tm_data, void *dst, struct pl_plane_data *src,
     }
 
     // Process plane
-    if (!vspl_tonemap_do_planes(tm_data, planes, src_repr, dst_repr)) {
+    if (!vspl_tonemap_do_planes(p, rr, tm_data, f, planes, src_repr, dst_repr)) {
         vsapi->logMessage(mtCritical, "Failed processing planes!\n", core);
         return false;
     }
 
-    // Download planes
-    ok = pl_tex_download(p->gpu, pl_tex_transfer_params(
-        .tex = p->tex_out[0],
-        .ptr = dst,
-    ));
+    // Download planes straight into the destination frame
+    for (int i = 0; i < 3; ++i)
+        ok &= vspl_download_start(p, i, p->tex_out[i], vsapi->getWritePtr(dst, i), vsapi->getStride(dst, i));
+
+    for (int i = 0; i < 3; ++i)
+        ok &= vspl_download_finish(p, i);
 
     if (!ok) {
         vsapi->logMessage(mtCritical, "Failed downloading data from the GPU!\n", core);
@@ -168,6 +263,62 @@ bool vspl_tonemap_filter(TMData *tm_data, void *dst, struct pl_plane_data *src,
     return true;
 }
 
+#ifdef HAVE_DOVI
+static bool vspl_tonemap_parse_rpu(TMData *tm_data, const VSFrame *frame, struct vspl_dovi_rpu *out, const VSAPI *vsapi)
+{
+    int err;
+    const VSMap *props = vsapi->getFramePropertiesRO(frame);
+    const uint8_t *data = (const uint8_t *) vsapi->mapGetData(props, "DolbyVisionRPU", 0, &err);
+    if (err)
+        return false;
+
+    const int size = vsapi->mapGetDataSize(props, "DolbyVisionRPU", 0, &err);
+    return size > 0 && vspl_dovi_cache_get(tm_data->dovi_cache, data, size, out);
+}
+
+/** Whether the RPU of `frame` reuses metadata from earlier frames. */
+static bool vspl_tonemap_rpu_defers(TMData *tm_data, const VSFrame *frame, const VSAPI *vsapi)
+{
+    struct vspl_dovi_rpu rpu;
+    return vspl_tonemap_parse_rpu(tm_data, frame, &rpu, vsapi) && (rpu.prev_mapping || rpu.prev_dm);
+}
+
+/**
+ * Parses the RPU of frame `n`. What it defers is taken from the closest of
+ * the VSPL_DOVI_MAX_PREV previous frames that carries it, which must have
+ * been requested if vspl_tonemap_rpu_defers(), so the result doesn't depend
+ * on the order frames are processed in. Repeated RPUs are parsed only once
+ * thanks to the cache. Returns false if frame `n` has no valid RPU, or if
+ * what it defers isn't found.
+ */
+static bool vspl_tonemap_get_rpu(TMData *tm_data, int n, const VSFrame *frame, struct vspl_dovi_rpu *rpu,
+                                 VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    if (!vspl_tonemap_parse_rpu(tm_data, frame, rpu, vsapi))
+        return false;
+
+    bool complete = !rpu->prev_mapping && !rpu->prev_dm;
+    if (complete)
+        return true;
+
+    struct vspl_dovi_rpu prev;
+    for (int k = 1; !complete && k <= VSPL_DOVI_MAX_PREV && n - k >= 0; k++) {
+        const VSFrame *prev_frame = vsapi->getFrameFilter(n - k, tm_data->node, frameCtx);
+
+        // A frame without a valid RPU ends the chain
+        if (!vspl_tonemap_parse_rpu(tm_data, prev_frame, &prev, vsapi)) {
+            vsapi->freeFrame(prev_frame);
+            break;
+        }
+
+        complete = vspl_dovi_inherit(rpu, &prev);
+        vsapi->freeFrame(prev_frame);
+    }
+
+    return complete;
+}
+#endif // HAVE_DOVI
+
 static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, void *instanceData, void **frameData,
                                           VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
 {
@@ -188,6 +339,20 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
             return NULL;
         }
 
+#ifdef HAVE_DOVI
+        // Most RPUs are self-contained, so previous frames are only requested
+        // for those that reuse earlier metadata. API4 allows requesting more
+        // frames here, we're activated again once they're ready.
+        if (tm_data->use_dovi && n > 0 && !*frameData && vspl_tonemap_rpu_defers(tm_data, frame, vsapi)) {
+            for (int k = 1; k <= VSPL_DOVI_MAX_PREV && n - k >= 0; k++)
+                vsapi->requestFrameFilter(n - k, tm_data->node, frameCtx);
+
+            *frameData = (void *) 1;
+            vsapi->freeFrame(frame);
+            return NULL;
+        }
+#endif
+
         int w = vsapi->getFrameWidth(frame, 0);
         int h = vsapi->getFrameHeight(frame, 0);
 
@@ -197,25 +362,29 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
         VSFrame *dst = vsapi->newVideoFrame(dst_fmt, w, h, frame, core);
 
         const bool srcIsRGB = src_fmt->colorFamily == cfRGB;
+        const bool dstIsRGB = dst_fmt->colorFamily == cfRGB;
 
         enum pl_color_system src_sys = srcIsRGB
                                         ? PL_COLOR_SYSTEM_RGB
                                         : PL_COLOR_SYSTEM_BT_2020_NC;
         enum pl_color_system dst_sys = PL_COLOR_SYSTEM_RGB;
 
+        // Integer samples are LSB-aligned in their container, e.g. 10 bits in 16
+        const bool src_float = src_fmt->sampleType == stFloat;
         struct pl_color_repr src_repr = {
             .bits = {
-                .sample_depth = 16,
-                .color_depth = 16,
+                .sample_depth = src_fmt->bytesPerSample * 8,
+                .color_depth = src_float ? src_fmt->bytesPerSample * 8 : src_fmt->bitsPerSample,
                 .bit_shift = 0
             },
             .sys = src_sys,
         };
 
+        // Output below the internal precision is dithered by the renderer
         struct pl_color_repr dst_repr = {
             .bits = {
-                .sample_depth = 16,
-                .color_depth = 16,
+                .sample_depth = dst_fmt->bytesPerSample * 8,
+                .color_depth = dst_fmt->sampleType == stFloat ? dst_fmt->bytesPerSample * 8 : dst_fmt->bitsPerSample,
                 .bit_shift = 0
             },
             .sys = dst_sys,
@@ -230,10 +399,10 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
             src_repr.levels = props_levels ? PL_COLOR_LEVELS_LIMITED : PL_COLOR_LEVELS_FULL;
         }
 
-        if (!srcIsRGB) {
+        if (!dstIsRGB) {
             dst_repr.levels = PL_COLOR_LEVELS_LIMITED;
 
-            if (!err && !props_levels) {
+            if (!srcIsRGB && !err && !props_levels) {
                 // Existing range & not limited
                 dst_repr.levels = PL_COLOR_LEVELS_FULL;
             }
@@ -245,7 +414,12 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
             }
         }
 
-        struct pl_color_space *src_pl_csp = tm_data->src_pl_csp;
+        // Everything below only touches this frame's copy, so it can run in parallel
+        struct vspl_tonemap_frame f = {
+            .src_csp = *tm_data->src_pl_csp,
+            .dst_csp = *tm_data->dst_pl_csp,
+        };
+        struct pl_color_space *src_pl_csp = &f.src_csp;
 
         // ST2086 metadata
         // Update metadata from props
@@ -255,11 +429,11 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
         src_pl_csp->hdr.max_cll = maxCll;
         src_pl_csp->hdr.max_fall = maxFall;
 
-        if (tm_data->original_src_max < 1) {
+        if (tm_data->src_pl_csp->hdr.max_luma < 1) {
             src_pl_csp->hdr.max_luma = vsapi->mapGetFloat(props, "MasteringDisplayMaxLuminance", 0, &err);
         }
 
-        if (tm_data->original_src_min <= 0) {
+        if (tm_data->src_pl_csp->hdr.min_luma <= 0) {
             src_pl_csp->hdr.min_luma = vsapi->mapGetFloat(props, "MasteringDisplayMinLuminance", 0, &err);
         }
 
@@ -287,6 +461,17 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
                 }
             }
         }
+
+        if (tm_data->scenes.num_frames && tm_data->scenes.max_pq[n] > 0) {
+#if PL_API_VER >= 257
+            src_pl_csp->hdr.max_pq_y = tm_data->scenes.max_pq[n];
+            src_pl_csp->hdr.avg_pq_y = tm_data->scenes.avg_pq[n];
+#else
+            const float scene_max_nits = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, tm_data->scenes.max_pq[n]);
+            src_pl_csp->hdr.scene_avg = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, tm_data->scenes.avg_pq[n]);
+            src_pl_csp->hdr.scene_max[0] = src_pl_csp->hdr.scene_max[1] = src_pl_csp->hdr.scene_max[2] = scene_max_nits;
+#endif // PL_API_VER >= 257
+        }
 #endif // PL_API_VER >= 246
 
         const double *primariesX = vsapi->mapGetFloatArray(props, "MasteringDisplayPrimariesX", &err);
@@ -316,146 +501,129 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
             pl_raw_primaries_merge(&src_pl_csp->hdr.prim, pl_raw_primaries_get(PL_COLOR_PRIM_DISPLAY_P3));
         }
 
-        tm_data->chromaLocation = vsapi->mapGetInt(props, "_ChromaLocation", 0, &err);
+        f.chroma_loc = vsapi->mapGetInt(props, "_ChromaLocation", 0, &err);
 
         // FFMS2 prop is -1 to match zimg
         // However, libplacebo matches AVChromaLocation
         if (!err) {
-            tm_data->chromaLocation += 1;
+            f.chroma_loc += 1;
         }
 
         // DOVI
-        struct pl_dovi_metadata *dovi_meta = NULL;
-        uint8_t dovi_profile = 0;
-
 #ifdef HAVE_DOVI
-        if (tm_data->use_dovi && vsapi->mapNumElements(props, "DolbyVisionRPU")) {
-            uint8_t *doviRpu = (uint8_t *) vsapi->mapGetData(props, "DolbyVisionRPU", 0, &err);
-            size_t doviRpuSize = (size_t) vsapi->mapGetDataSize(props, "DolbyVisionRPU", 0, &err);
+        struct vspl_dovi_rpu rpu_data;
+
+        if (tm_data->use_dovi && vsapi->mapNumElements(props, "DolbyVisionRPU") > 0) {
+            const struct vspl_dovi_rpu *dovi_rpu = NULL;
+            if (vspl_tonemap_get_rpu(tm_data, n, frame, &rpu_data, frameCtx, core, vsapi)) {
+                dovi_rpu = &rpu_data;
+            } else if (!atomic_exchange(&tm_data->dovi_warned, true)) {
+                // libplacebo can't decode Dolby Vision without the metadata
+                vsapi->logMessage(mtWarning, "placebo.Tonemap: Dolby Vision RPU is invalid or refers to metadata "
+                                  "that isn't available, e.g. after a cut. Ignoring the RPU for such frames, "
+                                  "a Dolby Vision source is decoded as BT.2020 YCbCr instead.\n", core);
+            }
 
-            if (doviRpu && doviRpuSize) {
-                DoviRpuOpaque *rpu = dovi_parse_unspec62_nalu(doviRpu, doviRpuSize);
-                const DoviRpuDataHeader *header = dovi_rpu_get_header(rpu);
+            // Profile 5, 7 or 8 mapping
+            if (tm_data->src_csp == CSP_DOVI && dovi_rpu) {
+                src_repr.sys = PL_COLOR_SYSTEM_DOLBYVISION;
+                src_repr.dovi = &dovi_rpu->meta;
 
-                if (!header) {
-                    fprintf(stderr, "Failed parsing RPU: %s\n", dovi_rpu_get_error(rpu));
-                } else {
-                    dovi_profile = header->guessed_profile;
-                    dovi_meta = create_dovi_meta(rpu, header);
+                if (dovi_rpu->profile == 5) {
+                    dst_repr.levels = PL_COLOR_LEVELS_FULL;
                 }
+            }
 
-                // Profile 5, 7 or 8 mapping
-                if (tm_data->src_csp == CSP_DOVI) {
-                    src_repr.sys = PL_COLOR_SYSTEM_DOLBYVISION;
-                    src_repr.dovi = dovi_meta;
-
-                    if (dovi_profile == 5) {
-                        dst_repr.levels = PL_COLOR_LEVELS_FULL;
-                    }
+            if (dovi_rpu && dovi_rpu->has_dm) {
+                // Should avoid changing the source black point when mapping to PQ
+                // As the source image already has a specific black point,
+                // and the RPU isn't necessarily ground truth on the actual coded values
+                //
+                // Set target black point to the same as source
+                if (tm_data->src_csp == CSP_DOVI && tm_data->dst_csp == CSP_HDR10) {
+                    f.dst_csp.hdr.min_luma = src_pl_csp->hdr.min_luma;
+                } else {
+                    src_pl_csp->hdr.min_luma = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, dovi_rpu->source_min_pq);
                 }
 
-                if (header) {
-                    if (header->vdr_dm_metadata_present_flag) {
-                        const DoviVdrDmData *vdr_dm_data = dovi_rpu_get_vdr_dm_data(rpu);
-
-                        // Should avoid changing the source black point when mapping to PQ
-                        // As the source image already has a specific black point,
-                        // and the RPU isn't necessarily ground truth on the actual coded values
-                        //
-                        // Set target black point to the same as source
-                        if (tm_data->src_csp == CSP_DOVI && tm_data->dst_csp == CSP_HDR10) {
-                            tm_data->dst_pl_csp->hdr.min_luma = src_pl_csp->hdr.min_luma;
-                        } else {
-                            src_pl_csp->hdr.min_luma =
-                                pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, vdr_dm_data->source_min_pq / 4095.0f);
-                        }
-
-                        src_pl_csp->hdr.max_luma =
-                            pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, vdr_dm_data->source_max_pq / 4095.0f);
+                src_pl_csp->hdr.max_luma = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, dovi_rpu->source_max_pq);
 
 #if PL_API_VER >= 246
-                        if (vdr_dm_data->dm_data.level1) {
-                            const DoviExtMetadataBlockLevel1 *l1 = vdr_dm_data->dm_data.level1;
-
+                if (dovi_rpu->has_l1) {
 #if PL_API_VER >= 257
-                            src_pl_csp->hdr.avg_pq_y = l1->avg_pq / 4095.0f;
-                            src_pl_csp->hdr.max_pq_y = l1->max_pq / 4095.0f;
+                    src_pl_csp->hdr.avg_pq_y = dovi_rpu->l1_avg_pq;
+                    src_pl_csp->hdr.max_pq_y = dovi_rpu->l1_max_pq;
 #else
-                            src_pl_csp->hdr.scene_avg = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, l1->avg_pq / 4095.0f);
+                    src_pl_csp->hdr.scene_avg = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, dovi_rpu->l1_avg_pq);
 
-                            const float max_luma = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, l1->max_pq / 4095.0f);
-                            src_pl_csp->hdr.scene_max[0] = src_pl_csp->hdr.scene_max[1] = src_pl_csp->hdr.scene_max[2] = max_luma;
+                    const float max_luma = pl_hdr_rescale(PL_HDR_PQ, PL_HDR_NITS, dovi_rpu->l1_max_pq);
+                    src_pl_csp->hdr.scene_max[0] = src_pl_csp->hdr.scene_max[1] = src_pl_csp->hdr.scene_max[2] = max_luma;
 #endif // PL_API_VER >= 257
-                        }
+                }
 #endif // PL_API_VER >= 246
 
-                        if (vdr_dm_data->dm_data.level6) {
-                            const DoviExtMetadataBlockLevel6 *meta = vdr_dm_data->dm_data.level6;
-
-                            if (!maxCll || !maxFall) {
-                                src_pl_csp->hdr.max_cll = meta->max_content_light_level;
-                                src_pl_csp->hdr.max_fall = meta->max_frame_average_light_level;
-                            }
-                        }
-
-                        dovi_rpu_free_vdr_dm_data(vdr_dm_data);
-                    }
-
-                    dovi_rpu_free_header(header);
+                if (dovi_rpu->has_l6 && (!maxCll || !maxFall)) {
+                    src_pl_csp->hdr.max_cll = dovi_rpu->max_cll;
+                    src_pl_csp->hdr.max_fall = dovi_rpu->max_fall;
                 }
-
-                dovi_rpu_free(rpu);
             }
         }
 #endif
 
-        pl_color_space_infer_map(src_pl_csp, tm_data->dst_pl_csp);
+        if (tm_data->quantize) {
+            vspl_tonemap_quantize(&src_pl_csp->hdr, tm_data->quantize);
+        }
+
+        pl_color_space_infer_map(src_pl_csp, &f.dst_csp);
 
         struct pl_plane_data planes[3] = {};
         for (int i = 0; i < 3; ++i) {
             planes[i] = (struct pl_plane_data) {
-                .type = PL_FMT_UNORM,
+                .type = src_float ? PL_FMT_FLOAT : PL_FMT_UNORM,
                 .width = vsapi->getFrameWidth(frame, i),
                 .height = vsapi->getFrameHeight(frame, i),
-                .pixel_stride = dst_fmt->bytesPerSample,
+                .pixel_stride = src_fmt->bytesPerSample,
                 .row_stride = vsapi->getStride(frame, i),
                 .pixels = vsapi->getReadPtr((VSFrame *) frame, i),
             };
 
-            planes[i].component_size[0] = 16;
+            planes[i].component_size[0] = src_fmt->bytesPerSample * 8;
             planes[i].component_pad[0] = 0;
             planes[i].component_map[0] = i;
         }
 
-        void *packed_dst = malloc(w * h * 2 * 3);
-        pthread_mutex_lock(&tm_data->lock); // libplacebo isn’t thread-safe
+        struct priv *p = vspl_pool_acquire(tm_data->pool); // libplacebo isn’t thread-safe
 
-        if (vspl_tonemap_reconfig(tm_data->vf, planes, core, vsapi)) {
-            vspl_tonemap_filter(tm_data, packed_dst, planes, core, vsapi, src_repr, dst_repr);
+        if (vspl_tonemap_reconfig(p, planes, dst_fmt, core, vsapi)) {
+            // Peak detection state lives in the renderer and has to see every frame
+            const int num_slots = tm_data->renderParams->peak_detect_params ? 1 : VSPL_TM_SLOTS;
+            pl_renderer rr = vspl_tonemap_renderer(p, &f, num_slots);
+
+            if (rr)
+                vspl_tonemap_filter(p, rr, tm_data, &f, dst, planes, core, vsapi, src_repr, dst_repr);
+            else
+                vsapi->logMessage(mtCritical, "Failed creating renderer!\n", core);
         }
 
-        pthread_mutex_unlock(&tm_data->lock);
+        vspl_pool_release(tm_data->pool, p);
 
-        struct p2p_buffer_param pack_params = {
-            .width = w,
-            .height = h,
-            .packing = p2p_bgr48_le,
-            .src[0] = packed_dst,
-            .src_stride[0] = w * 2 * 3,
-        };
+        // The output may not match the source's color family or subsampling
+        VSMap *dst_props = vsapi->getFramePropertiesRW(dst);
+        vsapi->mapSetInt(dst_props, "_ColorRange", dst_repr.levels == PL_COLOR_LEVELS_LIMITED, maReplace);
 
-        for (int i = 0; i < 3; ++i) {
-            pack_params.dst[i] = vsapi->getWritePtr(dst, i);
-            pack_params.dst_stride[i] = vsapi->getStride(dst, i);
+        if (dstIsRGB) {
+            vsapi->mapSetInt(dst_props, "_Matrix", 0, maReplace);
+        } else if (dst_repr.sys == PL_COLOR_SYSTEM_BT_709) {
+            vsapi->mapSetInt(dst_props, "_Matrix", 1, maReplace);
+        } else if (dst_repr.sys == PL_COLOR_SYSTEM_BT_2020_NC) {
+            vsapi->mapSetInt(dst_props, "_Matrix", 9, maReplace);
         }
 
-        p2p_unpack_frame(&pack_params, 0);
-        free(packed_dst);
-
-        #if PL_API_VER >= 185
-            if (dovi_meta)
-                free((void *) dovi_meta);
-        #endif
+        if (dst_fmt->subSamplingW || dst_fmt->subSamplingH) {
+            vsapi->mapSetInt(dst_props, "_ChromaLocation", vspl_tonemap_out_chroma_loc(f.chroma_loc) - 1, maReplace);
+        } else {
+            vsapi->mapDeleteKey(dst_props, "_ChromaLocation");
+        }
 
         vsapi->freeFrame(frame);
         return dst;
@@ -467,7 +635,11 @@ static const VSFrame *VS_CC VSPlaceboTMGetFrame(int n, int activationReason, voi
 static void VS_CC VSPlaceboTMFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     TMData *tm_data = (TMData *) instanceData;
     vsapi->freeNode(tm_data->node);
-    VSPlaceboUninit(tm_data->vf);
+    vspl_pool_destroy(&tm_data->pool);
+#ifdef HAVE_DOVI
+    vspl_dovi_cache_destroy(&tm_data->dovi_cache);
+#endif
+    vspl_hdr_scenes_free(&tm_data->scenes);
 
     free((void *) tm_data->src_pl_csp);
     free((void *) tm_data->dst_pl_csp);
@@ -475,7 +647,6 @@ static void VS_CC VSPlaceboTMFree(void *instanceData, VSCore *core, const VSAPI
     free((void *) tm_data->renderParams->color_map_params);
     free(tm_data->renderParams);
 
-    pthread_mutex_destroy(&tm_data->lock);
     free(tm_data);
 }
 
@@ -485,12 +656,6 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     int err;
     enum pl_log_level log_level;
 
-    if (pthread_mutex_init(&d.lock, NULL) != 0)
-    {
-        vsapi->mapSetError(out, "placebo.Tonemap: mutex init failed\n");
-        return;
-    }
-
     log_level = vsapi->mapGetInt(in, "log_level", 0, &err);
     if (err)
         log_level = PL_LOG_ERR;
@@ -498,16 +663,46 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     d.node = vsapi->mapGetNode(in, "clip", 0, 0);
     d.vi = vsapi->getVideoInfo(d.node);
     d.vi_out = *d.vi;
-    vsapi->getVideoFormatByID(
-        &d.vi_out.format,
-        d.vi->format.colorFamily == cfRGB ? pfRGB48 : pfYUV444P16,
-        core
-    );
 
-    d.vf = VSPlaceboInit(log_level);
+    int out_format = vsapi->mapGetIntSaturated(in, "format", 0, &err);
+    if (err)
+        out_format = d.vi->format.colorFamily == cfRGB ? pfRGB48 : pfYUV444P16;
+
+    const VSVideoFormat *out_fmt = &d.vi_out.format;
+    if (!vsapi->getVideoFormatByID(&d.vi_out.format, out_format, core)
+        || (out_fmt->colorFamily != cfRGB && out_fmt->colorFamily != cfYUV)
+        || (out_fmt->sampleType == stInteger ? out_fmt->bitsPerSample > 16 : out_fmt->bitsPerSample < 16)) {
+        vsapi->mapSetError(out, "placebo.Tonemap: Output format must be RGB or YUV, 8-16 bit integer or 16/32 bit float!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.vi->width % (1 << out_fmt->subSamplingW) || d.vi->height % (1 << out_fmt->subSamplingH)) {
+        vsapi->mapSetError(out, "placebo.Tonemap: Clip dimensions must be divisible by the output format's subsampling!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    const VSVideoFormat *in_fmt = &d.vi->format;
+    if (in_fmt->sampleType == stInteger ? in_fmt->bitsPerSample > 16 : in_fmt->bitsPerSample < 16) {
+        vsapi->mapSetError(out, "placebo.Tonemap: Input must be 8-16 bit integer or 16/32 bit float!");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    int num_contexts = vsapi->mapGetIntSaturated(in, "num_contexts", 0, &err);
+    if (err)
+        num_contexts = 1;
+
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS) {
+        vsapi->mapSetError(out, "placebo.Tonemap: num_contexts must be between 1 and " VSPL_STR(VSPL_MAX_CONTEXTS) "!");
+        vsapi->freeNode(d.node);
+        return;
+    }
 
-    if (d.vi->format.bitsPerSample != 16) {
-        vsapi->mapSetError(out, "placebo.Tonemap: Input must be 16 bits per sample!");
+    d.pool = vspl_pool_create(num_contexts, log_level);
+    if (!d.pool) {
+        vsapi->mapSetError(out, "placebo.Tonemap: Failed initializing GPU contexts!");
         vsapi->freeNode(d.node);
         return;
     }
@@ -578,6 +773,7 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     if (src_csp == CSP_DOVI && d.vi->format.colorFamily == cfRGB) {
         vsapi->mapSetError(out, "placebo.Tonemap: Dolby Vision source colorspace must be a YUV clip!");
         vsapi->freeNode(d.node);
+        vspl_pool_destroy(&d.pool);
 
         if (colorMapParams)
             free((void *) colorMapParams);
@@ -601,6 +797,7 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             break;
         default:
             vsapi->mapSetError(out, "Invalid source colorspace for tonemapping.\n");
+            vspl_pool_destroy(&d.pool);
             return;
     };
 
@@ -616,6 +813,7 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             break;
         default:
             vsapi->mapSetError(out, "Invalid target colorspace for tonemapping.\n");
+            vspl_pool_destroy(&d.pool);
             return;
     };
 
@@ -640,6 +838,46 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     if (err)
         use_dovi = src_csp == CSP_DOVI;
 
+    // Precomputed scene statistics replace live peak detection
+    const char *hdr_stats = vsapi->mapGetData(in, "hdr_stats", 0, &err);
+    d.scenes = (struct vspl_hdr_scenes) {0};
+    if (!err) {
+        const char *error = vspl_hdr_scenes_load(&d.scenes, hdr_stats, peakDetectParams->scene_threshold_high / 100.0f);
+        if (!error && d.scenes.num_frames != d.vi->numFrames)
+            error = "HDR statistics file doesn't match the clip's length!";
+
+        if (error) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "placebo.Tonemap: %s", error);
+            vsapi->mapSetError(out, msg);
+
+            vspl_hdr_scenes_free(&d.scenes);
+            vsapi->freeNode(d.node);
+            vspl_pool_destroy(&d.pool);
+            free((void *) colorMapParams);
+            free((void *) peakDetectParams);
+            free((void *) src_pl_csp);
+            free((void *) dst_pl_csp);
+            return;
+        }
+
+        peak_detection = 0;
+    }
+
+    d.quantize = vsapi->mapGetIntSaturated(in, "quantize_metadata", 0, &err);
+    if (d.quantize < 0 || d.quantize > 4095) {
+        vsapi->mapSetError(out, "placebo.Tonemap: quantize_metadata must be between 0 and 4095!");
+
+        vspl_hdr_scenes_free(&d.scenes);
+        vsapi->freeNode(d.node);
+        vspl_pool_destroy(&d.pool);
+        free((void *) colorMapParams);
+        free((void *) peakDetectParams);
+        free((void *) src_pl_csp);
+        free((void *) dst_pl_csp);
+        return;
+    }
+
     struct pl_render_params *renderParams = malloc(sizeof(struct pl_render_params));
     *renderParams = pl_render_default_params;
 
@@ -656,15 +894,21 @@ void VS_CC VSPlaceboTMCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     d.dst_pl_csp = dst_pl_csp;
     d.src_csp = src_csp;
     d.dst_csp = dst_csp;
-    d.original_src_max = src_max;
-    d.original_src_min = src_min;
     d.is_subsampled = d.vi->format.subSamplingW || d.vi->format.subSamplingH;
     d.use_dovi = use_dovi;
+    d.dovi_cache = NULL;
+
+#ifdef HAVE_DOVI
+    if (use_dovi)
+        d.dovi_cache = vspl_dovi_cache_create();
+#endif
 
-    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}};
+    // Dolby Vision also reads previous frames' RPUs
+    VSFilterDependency deps[] = {{d.node, use_dovi ? rpGeneral : rpStrictSpatial}};
 
     tm_data = malloc(sizeof(d));
     *tm_data = d;
+    atomic_init(&tm_data->dovi_warned, false);
 
     vsapi->createVideoFilter(
         out,
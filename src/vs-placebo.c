@@ -1,6 +1,17 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 #include <VapourSynth4.h>
 
@@ -9,6 +20,269 @@
 #include "tonemap.h"
 #include "resample.h"
 #include "shader.h"
+#include "analyze.h"
+
+struct vspl_stats vspl_stats;
+
+/**
+ * The Vulkan instance/device is shared by every filter instance in the
+ * process. Creating one is expensive (hundreds of ms and a separate memory
+ * heap), while `pl_gpu` itself is thread-safe, so only the dispatch and
+ * renderer objects are created per instance.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int refcount;
+    enum pl_log_level log_level;
+    pl_log log;
+    pl_vulkan vk;
+
+    // Persistent shader/pipeline cache, see vspl_cache_open()
+    char *cache_dir;
+#if PL_API_VER >= 338
+    pl_cache cache;
+    uint64_t cache_sig;
+    size_t cache_saved_size;
+#endif
+} vspl_device = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define VSPL_CACHE_FILE "vs-placebo.cache"
+
+// Cache growth after which it is written back without waiting for shutdown
+#define VSPL_CACHE_SAVE_STEP (256 * 1024)
+
+#if PL_API_VER >= 338
+static char *vspl_cache_path(const char *suffix)
+{
+    const char *dir = vspl_device.cache_dir;
+    size_t len = strlen(dir) + strlen(VSPL_CACHE_FILE) + strlen(suffix) + 2;
+    char *path = malloc(len);
+    if (path)
+        snprintf(path, len, "%s/%s%s", dir, VSPL_CACHE_FILE, suffix);
+    return path;
+}
+
+/** Merge the on-disk cache file, if any, into the in-memory cache. */
+static int vspl_cache_load(void)
+{
+    char *path = vspl_cache_path("");
+    if (!path)
+        return 0;
+
+    FILE *fl = fopen(path, "rb");
+    free(path);
+    if (!fl)
+        return 0;
+
+    int loaded = 0;
+    fseek(fl, 0, SEEK_END);
+    long size = ftell(fl);
+    rewind(fl);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (data && fread(data, 1, size, fl) == (size_t) size)
+        loaded = pl_cache_load(vspl_device.cache, data, size);
+
+    free(data);
+    fclose(fl);
+    return loaded > 0 ? loaded : 0;
+}
+
+/**
+ * Write the cache back to disk. Other processes may be using the same file,
+ * so entries they added since we loaded are merged in first, and the file is
+ * replaced atomically by renaming a private temporary file over it. Readers
+ * therefore only ever see a complete cache file.
+ */
+static void vspl_cache_save(void)
+{
+    if (pl_cache_signature(vspl_device.cache) == vspl_device.cache_sig) {
+        vspl_device.cache_saved_size = pl_cache_size(vspl_device.cache);
+        return; // nothing new
+    }
+
+    vspl_cache_load();
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long) getpid());
+
+    char *path = vspl_cache_path("");
+    char *tmp_path = vspl_cache_path(suffix);
+    uint8_t *data = NULL;
+    FILE *fl = NULL;
+
+    if (!path || !tmp_path)
+        goto done;
+
+    size_t size = pl_cache_save(vspl_device.cache, NULL, 0);
+    data = malloc(size);
+    if (!data)
+        goto done;
+
+    size = pl_cache_save(vspl_device.cache, data, size);
+
+    fl = fopen(tmp_path, "wb");
+    if (!fl) {
+        fprintf(stderr, "Failed writing shader cache %s\n", tmp_path);
+        goto done;
+    }
+
+    bool ok = fwrite(data, 1, size, fl) == size;
+    ok &= fclose(fl) == 0;
+    fl = NULL;
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+
+    if (!ok) {
+        fprintf(stderr, "Failed writing shader cache %s\n", path);
+        remove(tmp_path);
+    } else {
+        vspl_device.cache_sig = pl_cache_signature(vspl_device.cache);
+    }
+
+done:
+    // Also on failure, so a checkpoint doesn't retry on every frame
+    vspl_device.cache_saved_size = pl_cache_size(vspl_device.cache);
+
+    if (fl)
+        fclose(fl);
+    free(data);
+    free(tmp_path);
+    free(path);
+}
+
+/** Attach a cache to the shared GPU, if a cache directory is configured. */
+static void vspl_cache_open(void)
+{
+    if (vspl_device.cache || !vspl_device.cache_dir || !vspl_device.vk)
+        return;
+
+    vspl_device.cache = pl_cache_create(pl_cache_params(
+        .log = vspl_device.log,
+    ));
+
+    if (!vspl_device.cache)
+        return;
+
+    atomic_fetch_add(&vspl_stats.cache_objects_loaded, vspl_cache_load());
+    vspl_device.cache_sig = pl_cache_signature(vspl_device.cache);
+    vspl_device.cache_saved_size = pl_cache_size(vspl_device.cache);
+    pl_gpu_set_cache(vspl_device.vk->gpu, vspl_device.cache);
+}
+
+static void vspl_cache_close(void)
+{
+    if (!vspl_device.cache)
+        return;
+
+    pl_gpu_set_cache(vspl_device.vk->gpu, NULL);
+    vspl_cache_save();
+    pl_cache_destroy(&vspl_device.cache);
+}
+
+/**
+ * Writes the cache back early once it has grown by VSPL_CACHE_SAVE_STEP since
+ * it was last saved, so a crash or a host that never frees its core doesn't
+ * lose every shader compiled in the session. Called after every frame, and
+ * skipped if another thread holds the device lock.
+ */
+static void vspl_cache_checkpoint(void)
+{
+    if (pthread_mutex_trylock(&vspl_device.lock) != 0)
+        return;
+
+    if (vspl_device.cache && pl_cache_size(vspl_device.cache) >= vspl_device.cache_saved_size + VSPL_CACHE_SAVE_STEP)
+        vspl_cache_save();
+
+    pthread_mutex_unlock(&vspl_device.lock);
+}
+#else
+static void vspl_cache_open(void) {}
+static void vspl_cache_close(void) {}
+static void vspl_cache_checkpoint(void) {}
+#endif // PL_API_VER >= 338
+
+int64_t vspl_time_us(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+pl_vulkan vspl_device_acquire(enum pl_log_level log_level)
+{
+    pthread_mutex_lock(&vspl_device.lock);
+
+    if (vspl_device.vk) {
+        // Raise the verbosity of the shared log if this instance wants more
+        if (log_level > vspl_device.log_level) {
+            pl_log_level_update(vspl_device.log, log_level);
+            vspl_device.log_level = log_level;
+        }
+
+        goto done;
+    }
+
+    int64_t start = vspl_time_us();
+
+    vspl_device.log = pl_log_create(PL_API_VER, pl_log_params(
+        .log_cb = pl_log_color,
+        .log_level = log_level
+    ));
+    vspl_device.log_level = log_level;
+
+    if (!vspl_device.log) {
+        fprintf(stderr, "Failed initializing libplacebo\n");
+        goto error;
+    }
+
+    struct pl_vulkan_params vp = pl_vulkan_default_params;
+    struct pl_vk_inst_params ip = pl_vk_inst_default_params;
+//    ip.debug = true;
+    vp.instance_params = &ip;
+    vspl_device.vk = pl_vulkan_create(vspl_device.log, &vp);
+
+    if (!vspl_device.vk) {
+        fprintf(stderr, "Failed creating vulkan context\n");
+        goto error;
+    }
+
+    vspl_cache_open();
+
+    atomic_fetch_add(&vspl_stats.devices_created, 1);
+    atomic_fetch_add(&vspl_stats.device_init_us, vspl_time_us() - start);
+
+done:
+    vspl_device.refcount++;
+    atomic_fetch_add(&vspl_stats.device_refs, 1);
+    pthread_mutex_unlock(&vspl_device.lock);
+    return vspl_device.vk;
+
+error:
+    pl_log_destroy(&vspl_device.log);
+    pthread_mutex_unlock(&vspl_device.lock);
+    return NULL;
+}
+
+void vspl_device_release(void)
+{
+    pthread_mutex_lock(&vspl_device.lock);
+
+    atomic_fetch_sub(&vspl_stats.device_refs, 1);
+    if (--vspl_device.refcount == 0) {
+        vspl_cache_close();
+        pl_vulkan_destroy(&vspl_device.vk);
+        pl_log_destroy(&vspl_device.log);
+    }
+
+    pthread_mutex_unlock(&vspl_device.lock);
+}
 
 void *VSPlaceboInit(enum pl_log_level log_level) {
     struct priv *p = calloc(1, sizeof(struct priv));
@@ -25,11 +299,7 @@ void *VSPlaceboInit(enum pl_log_level log_level) {
         goto error;
     }
 
-    struct pl_vulkan_params vp = pl_vulkan_default_params;
-    struct pl_vk_inst_params ip = pl_vk_inst_default_params;
-//    ip.debug = true;
-    vp.instance_params = &ip;
-    p->vk = pl_vulkan_create(p->log, &vp);
+    p->vk = vspl_device_acquire(log_level);
 
     if (!p->vk) {
         fprintf(stderr, "Failed creating vulkan context\n");
@@ -51,6 +321,7 @@ void *VSPlaceboInit(enum pl_log_level log_level) {
         goto error;
     }
 
+    atomic_fetch_add(&vspl_stats.contexts, 1);
     return p;
 
 error:
@@ -61,20 +332,295 @@ error:
 void VSPlaceboUninit(void *priv)
 {
     struct priv *p = priv;
+    if (p->rr)
+        atomic_fetch_sub(&vspl_stats.contexts, 1);
+
     for (int i = 0; i < MAX_PLANES; i++) {
         pl_tex_destroy(p->gpu, &p->tex_in[i]);
         pl_tex_destroy(p->gpu, &p->tex_out[i]);
+        pl_tex_destroy(p->gpu, &p->tex_tmp[i]);
+        pl_buf_destroy(p->gpu, &p->ul_buf[i]);
+        pl_buf_destroy(p->gpu, &p->dl_buf[i]);
     }
 
+    pl_tex_destroy(p->gpu, &p->tex_sep);
+    pl_buf_destroy(p->gpu, &p->stats);
+
+    for (int i = 0; i < p->num_tex_pool; i++)
+        pl_tex_destroy(p->gpu, &p->tex_pool[i]);
+
+    // The first slot only borrows `rr`
+    for (int i = 1; i < VSPL_TM_SLOTS; i++)
+        pl_renderer_destroy(&p->tm_slots[i].rr);
+
     pl_renderer_destroy(&p->rr);
+    pl_shader_obj_destroy(&p->lut);
     pl_shader_obj_destroy(&p->dither_state);
     pl_dispatch_destroy(&p->dp);
-    pl_vulkan_destroy(&p->vk);
+
+    if (p->vk) {
+        p->vk = NULL;
+        vspl_device_release();
+    }
+
     pl_log_destroy(&p->log);
 
     free(p);
 }
 
+static bool vspl_tex_params_equal(const struct pl_tex_params *a, const struct pl_tex_params *b)
+{
+    return a->w == b->w && a->h == b->h && a->d == b->d &&
+           a->format == b->format &&
+           a->sampleable == b->sampleable &&
+           a->renderable == b->renderable &&
+           a->storable == b->storable &&
+           a->blit_src == b->blit_src &&
+           a->blit_dst == b->blit_dst &&
+           a->host_writable == b->host_writable &&
+           a->host_readable == b->host_readable;
+}
+
+/**
+ * Like pl_tex_recreate(), but a texture that no longer fits is parked in the
+ * context's pool instead of being destroyed, and a matching parked texture is
+ * reused before allocating a new one. This keeps e.g. luma and chroma sized
+ * textures alive when one slot alternates between them.
+ */
+bool vspl_tex_recreate(struct priv *p, pl_tex *tex, const struct pl_tex_params *params)
+{
+    if (*tex && vspl_tex_params_equal(&(*tex)->params, params)) {
+        atomic_fetch_add(&vspl_stats.tex_pool_hits, 1);
+        return true;
+    }
+
+    if (*tex) {
+        if (p->num_tex_pool == VSPL_TEX_POOL_SIZE) {
+            pl_tex_destroy(p->gpu, &p->tex_pool[0]);
+            memmove(&p->tex_pool[0], &p->tex_pool[1], (VSPL_TEX_POOL_SIZE - 1) * sizeof(pl_tex));
+            p->num_tex_pool--;
+        }
+
+        p->tex_pool[p->num_tex_pool++] = *tex;
+        *tex = NULL;
+    }
+
+    for (int i = 0; i < p->num_tex_pool; i++) {
+        if (!vspl_tex_params_equal(&p->tex_pool[i]->params, params))
+            continue;
+
+        *tex = p->tex_pool[i];
+        memmove(&p->tex_pool[i], &p->tex_pool[i + 1], (p->num_tex_pool - i - 1) * sizeof(pl_tex));
+        p->num_tex_pool--;
+
+        atomic_fetch_add(&vspl_stats.tex_pool_hits, 1);
+        return true;
+    }
+
+    atomic_fetch_add(&vspl_stats.tex_pool_misses, 1);
+    *tex = pl_tex_create(p->gpu, params);
+    return *tex != NULL;
+}
+
+/**
+ * Grows a host-mapped staging buffer to at least `size` bytes. Staging
+ * buffers live as long as their context and never shrink, so in steady state
+ * transfers don't allocate.
+ */
+static bool vspl_staging_recreate(struct priv *p, pl_buf *buf, size_t size)
+{
+    if (*buf && (*buf)->params.size >= size)
+        return true;
+
+    atomic_fetch_add(&vspl_stats.staging_allocs, 1);
+    return pl_buf_recreate(p->gpu, buf, pl_buf_params(
+        .size = size,
+        .host_mapped = true,
+        .memory_type = PL_BUF_MEM_HOST,
+    ));
+}
+
+/**
+ * Copies the pixels of `data` into the context's staging buffer for plane
+ * `idx` and points `data` at it. If the buffer can't be created, `data` is
+ * left alone and libplacebo stages the pixels itself.
+ */
+void vspl_stage_plane(struct priv *p, int idx, struct pl_plane_data *data)
+{
+    const size_t size = data->row_stride * data->height;
+    if (!vspl_staging_recreate(p, &p->ul_buf[idx], size))
+        return;
+
+    // An upload of an earlier frame, e.g. one that failed later on, may still read it
+    while (pl_buf_poll(p->gpu, p->ul_buf[idx], UINT64_MAX))
+        ; // busy
+
+    memcpy(p->ul_buf[idx]->data, data->pixels, size);
+    data->buf = p->ul_buf[idx];
+    data->buf_offset = 0;
+    data->pixels = NULL;
+}
+
+/**
+ * Downloads are issued for every plane without blocking and waited on
+ * afterwards, each through a host-mapped staging buffer of the context.
+ * VapourSynth frame memory is only touched by the CPU, so frames can be freed
+ * at any time, even with transfers still pending after an error.
+ *
+ * This only batches the planes of one frame. A GetFrame call has to return a
+ * finished frame, so a context never carries a download over into the next
+ * frame; overlap across frames comes from running several contexts.
+ */
+bool vspl_download_start(struct priv *p, int idx, pl_tex tex, uint8_t *dst, ptrdiff_t dst_stride)
+{
+    const size_t row_size = tex->params.w * tex->params.format->texel_size;
+
+    p->dl_dst[idx] = dst;
+    p->dl_stride[idx] = dst_stride;
+    p->dl_rows[idx] = tex->params.h;
+    p->dl_pitch[idx] = row_size;
+
+    return vspl_staging_recreate(p, &p->dl_buf[idx], row_size * tex->params.h)
+        && pl_tex_download(p->gpu, pl_tex_transfer_params(
+            .tex = tex,
+            .buf = p->dl_buf[idx],
+            .row_pitch = row_size,
+        ));
+}
+
+/**
+ * Waits for a download issued by vspl_download_start() and copies it into
+ * the frame. Polling submits all work recorded so far, so waiting on the first
+ * plane submits the whole frame as one batch and the remaining waits return
+ * right away.
+ */
+bool vspl_download_finish(struct priv *p, int idx)
+{
+    if (!p->dl_buf[idx])
+        return false;
+
+    while (pl_buf_poll(p->gpu, p->dl_buf[idx], UINT64_MAX))
+        ; // busy
+
+    const uint8_t *src = p->dl_buf[idx]->data;
+    const size_t row_pitch = p->dl_pitch[idx];
+    for (int y = 0; y < p->dl_rows[idx]; y++)
+        memcpy(p->dl_dst[idx] + y * p->dl_stride[idx], src + y * row_pitch, row_pitch);
+
+    return true;
+}
+
+struct vspl_pool *vspl_pool_create(int num_contexts, enum pl_log_level log_level)
+{
+    if (num_contexts < 1 || num_contexts > VSPL_MAX_CONTEXTS)
+        return NULL;
+
+    struct vspl_pool *pool = calloc(1, sizeof(struct vspl_pool));
+    if (!pool)
+        return NULL;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_contexts; i++) {
+        struct priv *p = VSPlaceboInit(log_level);
+        if (!p) {
+            vspl_pool_destroy(&pool);
+            return NULL;
+        }
+
+        pool->ctx[pool->num_ctx++] = p;
+        pool->free[pool->num_free++] = p;
+    }
+
+    return pool;
+}
+
+void vspl_pool_destroy(struct vspl_pool **pool)
+{
+    struct vspl_pool *pl = *pool;
+    if (!pl)
+        return;
+
+    for (int i = 0; i < pl->num_ctx; i++)
+        VSPlaceboUninit(pl->ctx[i]);
+
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+    *pool = NULL;
+}
+
+struct priv *vspl_pool_acquire(struct vspl_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->num_free)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+
+    struct priv *p = pool->free[--pool->num_free];
+    pthread_mutex_unlock(&pool->lock);
+    return p;
+}
+
+void vspl_pool_release(struct vspl_pool *pool, struct priv *p)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->num_free++] = p;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    vspl_cache_checkpoint();
+}
+
+static void vspl_set_cache_dir(const char *dir)
+{
+    pthread_mutex_lock(&vspl_device.lock);
+
+    // Flush whatever was cached so far to the old location
+    vspl_cache_close();
+
+    free(vspl_device.cache_dir);
+    vspl_device.cache_dir = NULL;
+
+    if (dir && *dir) {
+        size_t len = strlen(dir) + 1;
+        vspl_device.cache_dir = malloc(len);
+        if (vspl_device.cache_dir)
+            memcpy(vspl_device.cache_dir, dir, len);
+    }
+
+    vspl_cache_open();
+    pthread_mutex_unlock(&vspl_device.lock);
+}
+
+static void VS_CC VSPlaceboSetCacheDir(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    int err;
+    const char *dir = vsapi->mapGetData(in, "path", 0, &err);
+    vspl_set_cache_dir(err ? NULL : dir);
+}
+
+static void VS_CC VSPlaceboStats(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+#define STAT(name) vsapi->mapSetInt(out, #name, atomic_load(&vspl_stats.name), maReplace);
+    STAT(devices_created)
+    STAT(device_refs)
+    STAT(device_init_us)
+    STAT(contexts)
+    STAT(cache_objects_loaded)
+    STAT(tex_pool_hits)
+    STAT(tex_pool_misses)
+    STAT(staging_allocs)
+    STAT(tonemap_slot_evictions)
+#undef STAT
+}
+
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
     vspapi->configPlugin(
         "com.vs.placebo",
@@ -85,16 +631,23 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         0,
         plugin
     );
-    vspapi->registerFunction("Deband", "clip:vnode;planes:int:opt;iterations:int:opt;threshold:float:opt;"
-                           "radius:float:opt;grain:float:opt;dither:int:opt;dither_algo:int:opt;"
-                           "log_level:int:opt;", "clip:vnode;", VSPlaceboDebandCreate, 0, plugin);
+    vspapi->registerFunction("Deband", "clip:vnode;planes:int:opt;iterations:int[]:opt;threshold:float[]:opt;"
+                           "radius:float[]:opt;grain:float[]:opt;dither:int:opt;dither_algo:int:opt;bits:int:opt;"
+                           "num_contexts:int:opt;log_level:int:opt;", "clip:vnode;", VSPlaceboDebandCreate, 0, plugin);
 
     vspapi->registerFunction("Resample", "clip:vnode;width:int;height:int;filter:data:opt;clamp:float:opt;blur:float:opt;"
                              "taper:float:opt;radius:float:opt;param1:float:opt;param2:float:opt;"
                              "src_width:float:opt;src_height:float:opt;sx:float:opt;sy:float:opt;antiring:float:opt;"
                              "sigmoidize:int:opt;sigmoid_center:float:opt;sigmoid_slope:float:opt;linearize:int:opt;trc:int:opt;"
                              "min_luma:float:opt;"
-                             "log_level:int:opt;", "clip:vnode;", VSPlaceboResampleCreate, 0, plugin);
+                             "num_contexts:int:opt;log_level:int:opt;", "clip:vnode;", VSPlaceboResampleCreate, 0, plugin);
+
+    vspapi->registerFunction("ResampleMulti", "clip:vnode;widths:int[];heights:int[];filter:data:opt;clamp:float:opt;blur:float:opt;"
+                             "taper:float:opt;radius:float:opt;param1:float:opt;param2:float:opt;"
+                             "src_width:float:opt;src_height:float:opt;sx:float:opt;sy:float:opt;antiring:float:opt;"
+                             "sigmoidize:int:opt;sigmoid_center:float:opt;sigmoid_slope:float:opt;linearize:int:opt;trc:int:opt;"
+                             "min_luma:float:opt;"
+                             "num_contexts:int:opt;log_level:int:opt;", "clip:vnode[];", VSPlaceboResampleMultiCreate, 0, plugin);
 
     vspapi->registerFunction("Tonemap", "clip:vnode;"
                             "src_csp:int:opt;dst_csp:int:opt;"
@@ -111,12 +664,26 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
                             "use_dovi:int:opt;"
                             "visualize_lut:int:opt;show_clipping:int:opt;"
                             "contrast_recovery:float:opt;"
-                            "log_level:int:opt;", "clip:vnode;", VSPlaceboTMCreate, 0, plugin);
+                            "format:int:opt;hdr_stats:data:opt;quantize_metadata:int:opt;"
+                            "num_contexts:int:opt;log_level:int:opt;", "clip:vnode;", VSPlaceboTMCreate, 0, plugin);
 
     vspapi->registerFunction("Shader", "clip:vnode;shader:data:opt;width:int:opt;height:int:opt;chroma_loc:int:opt;matrix:int:opt;trc:int:opt;"
                            "linearize:int:opt;sigmoidize:int:opt;sigmoid_center:float:opt;sigmoid_slope:float:opt;"
                            "antiring:float:opt;"
                            "filter:data:opt;clamp:float:opt;blur:float:opt;taper:float:opt;radius:float:opt;"
-                           "param1:float:opt;param2:float:opt;shader_s:data:opt;"
-                           "log_level:int:opt;", "clip:vnode;", VSPlaceboShaderCreate, 0, plugin);
+                           "param1:float:opt;param2:float:opt;shader_s:data:opt;format:int:opt;"
+                           "num_contexts:int:opt;log_level:int:opt;", "clip:vnode;", VSPlaceboShaderCreate, 0, plugin);
+
+    vspapi->registerFunction("AnalyzeHDR", "clip:vnode;path:data:opt;src_csp:int:opt;"
+                           "num_contexts:int:opt;log_level:int:opt;", "clip:vnode;", VSPlaceboAnalyzeHDRCreate, 0, plugin);
+
+    vspapi->registerFunction("SetCacheDir", "path:data:opt;", "", VSPlaceboSetCacheDir, 0, plugin);
+
+    vspapi->registerFunction("Stats", "", "devices_created:int;device_refs:int;device_init_us:int;contexts:int;"
+                             "cache_objects_loaded:int;tex_pool_hits:int;tex_pool_misses:int;staging_allocs:int;"
+                             "tonemap_slot_evictions:int;", VSPlaceboStats, 0, plugin);
+
+    const char *cache_dir = getenv("VSPLACEBO_CACHE_DIR");
+    if (cache_dir)
+        vspl_set_cache_dir(cache_dir);
 }
@@ -1,6 +1,19 @@
 #ifndef VS_PLACEBO_LIBRARY_H
 #define VS_PLACEBO_LIBRARY_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <VapourSynth4.h>
+
+#include <libplacebo/config.h>
+#if PL_API_VER >= 338
+#include <libplacebo/cache.h>
+#endif
+#include <libplacebo/colorspace.h>
 #include <libplacebo/dispatch.h>
 #include <libplacebo/shaders/sampling.h>
 #include <libplacebo/utils/upload.h>
@@ -21,6 +34,12 @@ struct plane {
 };
 
 #define MAX_PLANES 4
+#define VSPL_MAX_CONTEXTS 32
+#define VSPL_TEX_POOL_SIZE 64
+#define VSPL_TM_SLOTS 4
+
+#define VSPL_STR_(x) #x
+#define VSPL_STR(x) VSPL_STR_(x)
 
 struct image {
     int width, height;
@@ -28,9 +47,17 @@ struct image {
     struct plane planes[MAX_PLANES];
 };
 
+/** A renderer and the colour spaces it last tone mapped between. */
+struct vspl_tm_slot {
+    pl_renderer rr;
+    struct pl_color_space src;
+    struct pl_color_space dst;
+    uint64_t last_used; // 0 if unused
+};
+
 struct priv {
     pl_log log;
-    pl_vulkan vk;
+    pl_vulkan vk; // shared, see vspl_device_acquire()
     pl_gpu gpu;
     pl_dispatch dp;
     pl_shader_obj dither_state;
@@ -38,9 +65,82 @@ struct priv {
     pl_renderer rr;
     pl_tex tex_in[MAX_PLANES];
     pl_tex tex_out[MAX_PLANES];
+    pl_tex tex_tmp[MAX_PLANES];
+    pl_tex tex_sep; // intermediate of separable two-pass scaling
+    pl_buf ul_buf[MAX_PLANES]; // staging, see vspl_stage_plane()
+    pl_buf dl_buf[MAX_PLANES];
+    size_t dl_pitch[MAX_PLANES];
+    int dl_rows[MAX_PLANES];
+    uint8_t *dl_dst[MAX_PLANES];
+    ptrdiff_t dl_stride[MAX_PLANES];
+
+    // Idle textures kept for reuse by vspl_tex_recreate(), oldest first
+    pl_tex tex_pool[VSPL_TEX_POOL_SIZE];
+    int num_tex_pool;
+
+    // Filter-specific per-context state
+    pl_shader_obj lut;
+    const struct pl_hook *hook;
+    pl_buf stats;
+
+    // Tonemap keeps one renderer per recently seen pair of colour spaces,
+    // so its LUTs survive frames alternating between metadata buckets. The
+    // first slot borrows `rr`, the others are created on demand. Each one
+    // holds its own LUTs and shader state on the GPU, for every context.
+    struct vspl_tm_slot tm_slots[VSPL_TM_SLOTS];
+    uint64_t tm_clock;
+};
+
+/**
+ * A fixed set of independent contexts, handed out to VapourSynth worker
+ * threads for the duration of one frame. `pl_gpu` is thread-safe, but the
+ * dispatch, renderer and textures are not, so each frame needs exclusive
+ * access to one context.
+ */
+struct vspl_pool {
+    struct priv *ctx[VSPL_MAX_CONTEXTS];
+    struct priv *free[VSPL_MAX_CONTEXTS];
+    int num_ctx;
+    int num_free;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/** Process-wide counters, reported by placebo.Stats(). */
+struct vspl_stats {
+    atomic_llong devices_created;
+    atomic_llong device_refs;
+    atomic_llong device_init_us;
+    atomic_llong contexts;
+    atomic_llong cache_objects_loaded;
+    atomic_llong tex_pool_hits;
+    atomic_llong tex_pool_misses;
+    atomic_llong staging_allocs;
+    atomic_llong tonemap_slot_evictions;
 };
 
+extern struct vspl_stats vspl_stats;
+
+int64_t vspl_time_us(void);
+
+pl_vulkan vspl_device_acquire(enum pl_log_level log_level);
+void vspl_device_release(void);
+
 void *VSPlaceboInit(enum pl_log_level log_level);
 void VSPlaceboUninit(void *priv);
 
+
+bool vspl_tex_recreate(struct priv *p, pl_tex *tex, const struct pl_tex_params *params);
+
+void vspl_stage_plane(struct priv *p, int idx, struct pl_plane_data *data);
+
+bool vspl_download_start(struct priv *p, int idx, pl_tex tex, uint8_t *dst, ptrdiff_t dst_stride);
+bool vspl_download_finish(struct priv *p, int idx);
+
+struct vspl_pool *vspl_pool_create(int num_contexts, enum pl_log_level log_level);
+void vspl_pool_destroy(struct vspl_pool **pool);
+struct priv *vspl_pool_acquire(struct vspl_pool *pool);
+void vspl_pool_release(struct vspl_pool *pool, struct priv *p);
+
 #endif //VS_PLACEBO_LIBRARY_H